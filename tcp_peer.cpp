@@ -1,7 +1,7 @@
 // tcp_peer.cpp
 // A single program that can either:
-//   - wait for a connection (--listen PORT), or
-//   - make a connection   (--connect HOST PORT).
+//   - wait for connections (--listen PORT), or
+//   - make a connection    (--connect HOST PORT).
 // After connected, you can type lines and press Enter to send;
 // incoming lines are printed to the screen.
 //
@@ -13,43 +13,97 @@
 //
 // Notes:
 // - This uses plain TCP (no HTTP). Both sides are equal once connected.
-// - Each "message" is a line of text ending in '\n' (newline).
-// - No extra libraries; uses the OS socket calls available on Linux/macOS.
+// - Each "message" is a line of text ending in '\n' (newline), or with
+//   --framing=bitcoin, a Bitcoin P2P message: a 24-byte header (magic,
+//   command, payload length, checksum) followed by the payload.
+// - No extra libraries; uses the OS socket calls available on Linux.
+// - One epoll loop watches stdin and every connected peer, so the same code
+//   handles one peer or hundreds.
+// - Sending never blocks: each peer has its own queue, written whenever the
+//   socket is writable. A peer more than --send-hwm bytes behind is dropped,
+//   so one slow peer can't hold up the others. Messages queued in one loop
+//   iteration (or within --coalesce-ms) go out together in one sendmsg().
+//   With --zerocopy-min, large messages are sent with MSG_ZEROCOPY.
+// - --send-file / --recv-file turn connections into file streams: sendfile()
+//   on one side, splice() through a pipe into the file on the other, so the
+//   bytes never pass through user space.
+// - --engine=uring moves socket reads and writes onto io_uring (Linux 6.0+):
+//   multishot recv into kernel-provided buffers, sends batched into one
+//   io_uring_enter() per loop iteration.
 
 #include <arpa/inet.h>   // inet_pton, inet_ntop, htons, htonl
 #include <netinet/in.h>  // sockaddr_in, INADDR_ANY
-#include <sys/socket.h>  // socket, bind, listen, accept, connect, send, recv
-#include <sys/select.h>  // select to wait on stdin and socket together
-#include <unistd.h>      // read, write, close
+#include <linux/tcp.h>   // TCP_INFO (the kernel's tcp_info has more fields than glibc's)
+#include <sys/socket.h>  // socket, bind, listen, accept, connect, sendmsg, recv
+#include <sys/uio.h>     // iovec
+#include <linux/errqueue.h> // sock_extended_err: MSG_ZEROCOPY completions
+#include <sys/epoll.h>   // epoll: wait on stdin and many sockets together
+#include <sys/eventfd.h> // eventfd: wake another thread's event loop
+#include <sys/signalfd.h> // signalfd: SIGUSR1 as an event-loop event
+#include <signal.h>      // sigset_t, pthread_sigmask
+#include <sys/mman.h>    // mmap for the io_uring rings
+#include <time.h>        // clock_gettime on another thread's CPU clock
+#include <sys/resource.h> // getrusage: CPU time for the benchmarks
+#include <sys/sendfile.h> // sendfile: file -> socket inside the kernel
+#include <sys/stat.h>    // fstat (file size)
+#include <sys/syscall.h> // io_uring_setup/enter/register (no libc wrappers)
+#include <linux/io_uring.h>
+#include <unistd.h>      // read, write, close, pipe2
+#include <fcntl.h>       // open, splice, F_SETPIPE_SZ
 #include <cerrno>        // errno
+#include <charconv>      // std::from_chars: options, latency probe fields
+#include <chrono>        // std::chrono::steady_clock for timers
+#include <cstddef>       // offsetof
+#include <cstdint>       // uint32_t, uint64_t
+#include <algorithm>     // std::min, std::max
+#include <atomic>        // std::atomic (output counters shared by threads)
+#include <bit>           // std::bit_ceil (io_uring ring sizes)
+#include <cmath>         // std::ceil
+#include <cstdio>        // std::snprintf
 #include <cstring>       // std::memset, std::strerror
+#include <deque>         // std::deque (send queues, set-aside completions)
 #include <iostream>      // std::cout, std::cerr
+#include <limits>        // std::numeric_limits (option bounds)
+#include <functional>    // std::function
+#include <memory>        // std::unique_ptr, std::shared_ptr
+#include <mutex>         // std::mutex, std::lock_guard
+#include <pthread.h>     // pthread_setaffinity_np
+#include <random>        // std::mt19937 for backoff jitter
+#include <set>           // std::set (timer queue)
 #include <string>        // std::string
+#include <string_view>   // std::string_view
+#include <thread>        // std::thread
+#include <type_traits>   // std::type_identity_t
+#include <unordered_map> // std::unordered_map
+#include <vector>        // std::vector
+#if defined(__x86_64__)
+#include <cpuid.h>       // __get_cpuid: SHA extensions check
+#include <immintrin.h>   // SSE2 / AVX2 / SHA intrinsics
+#endif
 
 // -------------- tiny helpers --------------
 
-// send_all_bytes: ensure we send the whole string (TCP may send in chunks)
-static bool send_all_bytes(int socket_fd, const std::string& text) {
-  const char* data = text.data();
-  size_t left = text.size();
-  while (left > 0) {
-    ssize_t n = ::send(socket_fd, data, left, 0);
-    if (n < 0) {
-      if (errno == EINTR) continue; // interrupted; try again
-      std::cerr << "send error: " << std::strerror(errno) << "\n";
-      return false;
-    }
-    if (n == 0) return false;       // peer closed unexpectedly
-    data += n;
-    left -= static_cast<size_t>(n);
-  }
-  return true;
-}
+// syscall_count: system calls this thread made on the message path
+// (epoll_wait, io_uring_enter, recv, sendmsg, read, write), for the
+// benchmarks' syscalls-per-message figure
+static thread_local uint64_t syscall_count = 0;
 
-// connect_to_peer: make an outgoing TCP connection to host:port
+// SendStats: what one connection's writes took: system calls (io_uring
+// sends with --engine=uring), how many of them the socket took only part
+// of, and the bytes it took
+struct SendStats {
+  uint64_t calls = 0;
+  uint64_t partial = 0;
+  uint64_t bytes = 0;
+};
+
+// connect_to_peer: start an outgoing TCP connection to host:port.
+// The socket is non-blocking, so this returns at once with the handshake
+// usually still in progress; the socket becomes writable when it finishes
+// and SO_ERROR then says whether it worked. A dead peer can't stall us.
 static int connect_to_peer(const std::string& host, int port) {
   // Create a TCP socket
-  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (fd < 0) {
     std::cerr << "socket() failed: " << std::strerror(errno) << "\n";
     return -1;
@@ -68,20 +122,25 @@ static int connect_to_peer(const std::string& host, int port) {
     return -1;
   }
 
-  // Try to connect
-  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
-    std::cerr << "connect() failed: " << std::strerror(errno) << "\n";
+  // Start connecting; EINPROGRESS just means "not finished yet"
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 &&
+      errno != EINPROGRESS) {
+    std::cerr << "connect() to " << host << ":" << port << " failed: "
+              << std::strerror(errno) << "\n";
     ::close(fd);
     return -1;
   }
 
-  return fd; // success: this is the connected socket
+  return fd; // connecting (or already connected)
 }
 
-// listen_and_accept: wait for one incoming TCP connection on port
-static int listen_and_accept(int port) {
-  // Create a TCP socket
-  int listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+// open_listener: bind a non-blocking listening socket on port.
+// The event loop accepts from it for as long as the program runs.
+// With reuse_port, several sockets may bind the same port (one per worker
+// thread) and the kernel spreads incoming connections across them.
+static int open_listener(int port, bool reuse_port) {
+  // Create a TCP socket (non-blocking: accept() must never stall the loop)
+  int listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (listen_fd < 0) {
     std::cerr << "socket() failed: " << std::strerror(errno) << "\n";
     return -1;
@@ -90,6 +149,12 @@ static int listen_and_accept(int port) {
   // Allow quick restart on same port
   int reuse = 1;
   ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  if (reuse_port &&
+      ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+    std::cerr << "setsockopt(SO_REUSEPORT) failed: " << std::strerror(errno) << "\n";
+    ::close(listen_fd);
+    return -1;
+  }
 
   // Bind to all network interfaces on given port
   sockaddr_in addr;
@@ -104,185 +169,4291 @@ static int listen_and_accept(int port) {
     return -1;
   }
 
-  // Start listening; backlog = 1 (we accept only one peer in this toy)
-  if (::listen(listen_fd, 1) < 0) {
+  // Start listening with a large backlog, so a burst of peers reconnecting
+  // at once waits in the kernel queue instead of being refused
+  if (::listen(listen_fd, SOMAXCONN) < 0) {
     std::cerr << "listen() failed: " << std::strerror(errno) << "\n";
     ::close(listen_fd);
     return -1;
   }
 
-  std::cout << "listening on port " << port << " ... waiting for one peer\n";
+  return listen_fd;
+}
 
-  // Wait for one incoming connection
-  sockaddr_in peer_addr;
-  socklen_t peer_len = sizeof(peer_addr);
-  int conn_fd = ::accept(listen_fd, reinterpret_cast<sockaddr*>(&peer_addr), &peer_len);
-  if (conn_fd < 0) {
-    std::cerr << "accept() failed: " << std::strerror(errno) << "\n";
-    ::close(listen_fd);
-    return -1;
+// address_text: "ip:port" for an IPv4 socket address
+static std::string address_text(const sockaddr_in& addr) {
+  char ip_text[INET_ADDRSTRLEN] = {0};
+  ::inet_ntop(AF_INET, &addr.sin_addr, ip_text, sizeof(ip_text));
+  return std::string(ip_text) + ":" + std::to_string(ntohs(addr.sin_port));
+}
+
+// -------------- event loop (epoll) --------------
+
+// Reactor: one epoll instance that owns every fd we care about.
+// Each fd is registered once with a handler; run() waits for readiness and
+// calls the handler of every fd that is ready. Unlike select() there is no
+// FD_SETSIZE limit and no per-iteration rebuild of the watched set.
+// It also runs one-shot timers: epoll_wait sleeps until the earliest one.
+class Reactor {
+ public:
+  using Handler = std::function<void(uint32_t events)>;
+  using TimerId = uint64_t;
+
+  // now_ms: monotonic clock in milliseconds (never jumps with wall time)
+  static int64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
   }
 
-  // Optional: print where they came from
-  char ip_text[INET_ADDRSTRLEN] = {0};
-  ::inet_ntop(AF_INET, &peer_addr.sin_addr, ip_text, sizeof(ip_text));
-  int peer_port = ntohs(peer_addr.sin_port);
-  std::cout << "connected to peer " << ip_text << ":" << peer_port << "\n";
+  Reactor() = default;
+  Reactor(const Reactor&) = delete;
+  Reactor& operator=(const Reactor&) = delete;
+  ~Reactor() {
+    if (epoll_fd_ >= 0) ::close(epoll_fd_);
+  }
 
-  // We no longer need the listening socket (single connection toy)
-  ::close(listen_fd);
-  return conn_fd; // success: this is the connected socket
-}
+  bool open() {
+    epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+      std::cerr << "epoll_create1() failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    return true;
+  }
 
-// -------------- main --------------
+  // add: start watching fd for `events` (EPOLLIN, EPOLLOUT, ...)
+  bool add(int fd, uint32_t events, Handler handler) {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      // EPERM: fd is a regular file, which epoll can't watch; callers handle it
+      if (errno != EPERM) std::cerr << "epoll_ctl(ADD) failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    if (static_cast<size_t>(fd) >= handlers_.size()) handlers_.resize(fd + 1);
+    handlers_[fd] = std::move(handler);
+    return true;
+  }
 
-int main(int argc, char** argv) {
-  // Very simple argument handling:
-  //   --listen PORT
-  //   --connect HOST PORT
-  if (argc >= 3 && std::string(argv[1]) == "--listen") {
-    int port = std::stoi(argv[2]);
-    int socket_fd = listen_and_accept(port);
-    if (socket_fd < 0) return 1;
+  // modify: change the events we wait for on an already registered fd
+  bool modify(int fd, uint32_t events) {
+    epoll_event ev;
+    std::memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    if (::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev) < 0) {
+      std::cerr << "epoll_ctl(MOD) failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    return true;
+  }
 
-    std::cout << "type a message and press Enter to send; Ctrl+D to quit\n";
+  // remove: stop watching fd (call before closing it)
+  void remove(int fd) {
+    ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+    if (static_cast<size_t>(fd) < handlers_.size()) handlers_[fd] = nullptr;
+  }
 
-    // We will use select() to watch both:
-    //   - your keyboard (stdin, fd=0)
-    //   - the network socket (socket_fd)
-    std::string incoming_buffer; // holds partial bytes until a full line arrives
+  // add_timer: call fn once, delay_ms from now. The id can cancel it.
+  TimerId add_timer(int64_t delay_ms, std::function<void()> fn) {
+    TimerId id = next_timer_id_++;
+    int64_t deadline = now_ms() + delay_ms;
+    timer_queue_.insert({deadline, id});
+    timers_[id] = Timer{deadline, std::move(fn)};
+    return id;
+  }
 
-    while (true) {
-      // Build a set of fds we want to watch
-      fd_set read_set;
-      FD_ZERO(&read_set);
-      FD_SET(0, &read_set);              // 0 = stdin
-      FD_SET(socket_fd, &read_set);      // network socket
-
-      // Wait until either stdin OR the socket has data
-      int max_fd = (socket_fd > 0 ? socket_fd : 0);
-      int ready = ::select(max_fd + 1, &read_set, nullptr, nullptr, nullptr);
+  // cancel_timer: forget a timer that hasn't fired yet (unknown ids are fine)
+  void cancel_timer(TimerId id) {
+    auto it = timers_.find(id);
+    if (it == timers_.end()) return;
+    timer_queue_.erase({it->second.deadline, id});
+    timers_.erase(it);
+  }
+
+  void stop() { running_ = false; }
+
+  // before_wait: called once per loop iteration, just before we sleep.
+  // The io_uring engine uses it to submit everything queued in one syscall.
+  void set_before_wait(std::function<void()> hook) { before_wait_ = std::move(hook); }
+
+  // run: wait for events and dispatch them until stop() is called
+  void run() {
+    running_ = true;
+    epoll_event events[64];
+    while (running_) {
+      if (before_wait_) before_wait_();
+      if (!running_) break; // the hook may have stopped us
+      int ready = ::epoll_wait(epoll_fd_, events, 64, wait_timeout_ms());
+      ++syscall_count;
       if (ready < 0) {
         if (errno == EINTR) continue;    // interrupted by signal; retry
-        std::cerr << "select() failed: " << std::strerror(errno) << "\n";
+        std::cerr << "epoll_wait() failed: " << std::strerror(errno) << "\n";
         break;
       }
+      for (int i = 0; i < ready && running_; ++i) {
+        int fd = events[i].data.fd;
+        // A handler earlier in this batch may have removed this fd
+        if (static_cast<size_t>(fd) >= handlers_.size() || !handlers_[fd]) continue;
+        // Copy the handler: it may remove (and so destroy) itself while running
+        Handler handler = handlers_[fd];
+        handler(events[i].events);
+      }
+      run_due_timers();
+    }
+  }
 
-      // If there's keyboard input ready, read a line and send it to the peer
-      if (FD_ISSET(0, &read_set)) {
-        std::string line;
-        if (!std::getline(std::cin, line)) {
-          std::cout << "stdin closed; goodbye\n";
-          break;
-        }
-        // Add the newline that marks the end of our message
-        line.push_back('\n');
-        if (!send_all_bytes(socket_fd, line)) {
-          std::cerr << "failed to send to peer\n";
-          break;
-        }
+ private:
+  struct Timer {
+    int64_t deadline;
+    std::function<void()> fn;
+  };
+
+  // wait_timeout_ms: how long epoll_wait may sleep (-1 = no timers)
+  int wait_timeout_ms() const {
+    if (timer_queue_.empty()) return -1;
+    int64_t wait = timer_queue_.begin()->first - now_ms();
+    return wait < 0 ? 0 : static_cast<int>(wait);
+  }
+
+  void run_due_timers() {
+    int64_t now = now_ms();
+    while (running_ && !timer_queue_.empty() && timer_queue_.begin()->first <= now) {
+      TimerId id = timer_queue_.begin()->second;
+      timer_queue_.erase(timer_queue_.begin());
+      auto it = timers_.find(id);
+      std::function<void()> fn = std::move(it->second.fn);
+      timers_.erase(it);
+      fn(); // may add or cancel other timers
+    }
+  }
+
+  int epoll_fd_ = -1;
+  bool running_ = false;
+  std::vector<Handler> handlers_; // indexed by fd
+  std::function<void()> before_wait_;
+  std::set<std::pair<int64_t, TimerId>> timer_queue_; // (deadline, id), earliest first
+  std::unordered_map<TimerId, Timer> timers_;
+  TimerId next_timer_id_ = 1;
+};
+
+// -------------- io_uring engine (optional) --------------
+
+// glibc has no io_uring wrappers and we don't want liburing, so call the
+// three system calls directly.
+static int sys_io_uring_setup(unsigned entries, io_uring_params* params) {
+  return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+static int sys_io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags) {
+  ++syscall_count;
+  return static_cast<int>(::syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                                    flags, nullptr, 0));
+}
+static int sys_io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return static_cast<int>(::syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args));
+}
+
+// UringEngine: socket reads and writes through io_uring instead of recv/send.
+//
+// Reads: each socket gets ONE multishot recv. The kernel picks a buffer from
+// a ring we registered up front (a "provided buffer ring"), fills it, and
+// posts a completion; the recv stays armed, so there is no syscall per read.
+//
+// Writes: send() only queues the bytes and prepares an SQE. All SQEs
+// prepared during a loop iteration go to the kernel in one io_uring_enter(),
+// called from the reactor's before_wait hook.
+//
+// Completions are found by watching the ring fd with the same epoll reactor,
+// so stdin and timers keep working exactly as in the plain epoll engine.
+//
+// The completion queue and the buffer ring are sized for the number of
+// peers we may have, since every peer keeps a recv armed. If the CQ fills
+// anyway, the kernel parks completions on an overflow list (and may refuse
+// submissions with EBUSY) until we ask it to move them back with
+// IORING_ENTER_GETEVENTS; reap() and submit() both do that.
+class UringEngine {
+ public:
+  // on_recv: bytes arrived on fd (only valid during the call)
+  using RecvCallback = std::function<void(int fd, const char* data, size_t len)>;
+  // on_close: the connection ended; res == 0 means the peer closed, else -errno
+  using CloseCallback = std::function<void(int fd, int res)>;
+
+  UringEngine() = default;
+  UringEngine(const UringEngine&) = delete;
+  UringEngine& operator=(const UringEngine&) = delete;
+
+  ~UringEngine() {
+    if (buf_ring_ != nullptr) ::munmap(buf_ring_, buf_ring_bytes_);
+    if (sqes_ != nullptr) ::munmap(sqes_, sqes_bytes_);
+    if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_) ::munmap(cq_ptr_, cq_bytes_);
+    if (sq_ptr_ != nullptr) ::munmap(sq_ptr_, sq_bytes_);
+    if (ring_fd_ >= 0) ::close(ring_fd_);
+  }
+
+  // open: create the ring and register the receive buffers, sized for
+  // up to `peers` connections. Returns false (with a message) if this
+  // kernel can't do it.
+  bool open(RecvCallback on_recv, CloseCallback on_close, size_t peers) {
+    on_recv_ = std::move(on_recv);
+    on_close_ = std::move(on_close);
+    peers = std::min(peers, kMaxCqEntries); // the fd limit may be "unlimited"
+    buffer_count_ = static_cast<uint16_t>(std::clamp<size_t>(std::bit_ceil(peers), kMinBuffers,
+                                                             kMaxBuffers));
+
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    // Room for a completion per buffer, one per send and one per peer
+    // whose recv ended, with slack
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    params.cq_entries = static_cast<uint32_t>(
+        std::clamp<size_t>(std::bit_ceil(buffer_count_ + 2 * peers), 2 * kEntries, kMaxCqEntries));
+    ring_fd_ = sys_io_uring_setup(kEntries, &params);
+    if (ring_fd_ < 0) {
+      std::cerr << "io_uring_setup() failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP)) {
+      std::cerr << "io_uring: kernel too old (need single mmap + nodrop)\n";
+      return false;
+    }
+
+    // Map the submission ring, completion ring (same mapping) and SQE array
+    sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (cq_bytes_ > sq_bytes_) sq_bytes_ = cq_bytes_;
+    cq_bytes_ = sq_bytes_;
+    sq_ptr_ = ::mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_SQ_RING);
+    if (sq_ptr_ == MAP_FAILED) {
+      sq_ptr_ = nullptr;
+      std::cerr << "io_uring: mmap(sq) failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    cq_ptr_ = sq_ptr_;
+    sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+    void* sqes = ::mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      std::cerr << "io_uring: mmap(sqes) failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+    char* sq = static_cast<char*>(sq_ptr_);
+    sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_flags_ = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+    sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    char* cq = static_cast<char*>(cq_ptr_);
+    cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    sq_local_tail_ = *sq_tail_;
+
+    // Provided buffer ring: buffer_count_ buffers of kBufferSize bytes.
+    // The kernel takes one per completed recv; we hand it back after use.
+    // When it runs out, a recv ends with ENOBUFS and handle_recv re-arms it.
+    buf_ring_bytes_ = buffer_count_ * sizeof(io_uring_buf);
+    void* ring = ::mmap(nullptr, buf_ring_bytes_, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+      std::cerr << "io_uring: mmap(buffer ring) failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    buf_ring_ = static_cast<io_uring_buf_ring*>(ring);
+    buffers_.resize(static_cast<size_t>(buffer_count_) * kBufferSize);
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = buffer_count_;
+    reg.bgid = kBufferGroup;
+    if (sys_io_uring_register(ring_fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      std::cerr << "io_uring: provided buffer rings unsupported: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    for (uint16_t bid = 0; bid < buffer_count_; ++bid) put_buffer(bid);
+    return true;
+  }
+
+  int ring_fd() const { return ring_fd_; }
+
+  // start_recv: arm the multishot recv for a newly connected socket
+  void start_recv(int fd) {
+    Slot& slot = slot_for(fd);
+    slot.active = true;
+    arm_recv(fd, slot);
+  }
+
+  // send: queue bytes for fd. They are copied, so the caller may reuse them.
+  void send(int fd, const char* data, size_t len) {
+    Slot& slot = slot_for(fd);
+    if (!slot.active) return;
+    slot.pending.insert(slot.pending.end(), data, data + len);
+    if (!slot.send_inflight) start_send(fd, slot);
+  }
+
+  // queued: bytes accepted by send() for fd that the kernel hasn't sent yet
+  size_t queued(int fd) {
+    const Slot& slot = slot_for(fd);
+    return slot.inflight.size() - slot.inflight_offset + slot.pending.size();
+  }
+
+  // send_stats: fd's sends so far
+  const SendStats& send_stats(int fd) { return slot_for(fd).stats; }
+
+  // forget: the connection is being closed; ignore its late completions.
+  // shutdown() ends the multishot recv so the kernel drops its reference.
+  void forget(int fd) {
+    Slot& slot = slot_for(fd);
+    if (!slot.active) return;
+    ::shutdown(fd, SHUT_RDWR);
+    if (slot.send_inflight) {
+      // The kernel may still be reading this buffer; keep it until its CQE
+      orphaned_sends_[user_data(kSend, fd, slot.gen)] = std::move(slot.inflight);
+      --sends_inflight_;
+    }
+    slot = Slot{};
+    slot.gen = next_gen_++ & kGenMask;
+  }
+
+  // submit: hand every prepared SQE to the kernel in one system call.
+  // Returns false if the kernel took none (they are retried next time).
+  bool submit() {
+    unsigned to_submit = sq_local_tail_ - submitted_tail_;
+    if (to_submit == 0) return true;
+    __atomic_store_n(sq_tail_, sq_local_tail_, __ATOMIC_RELEASE);
+    int n = sys_io_uring_enter(ring_fd_, to_submit, 0, 0);
+    if (n < 0) {
+      if (errno == EBUSY) {
+        // The CQ overflowed and the kernel wants it drained first. Move
+        // what fits back into the CQ; the ring fd is then readable and
+        // reap() takes care of the rest.
+        flush_overflow();
+      } else if (errno != EINTR && errno != EAGAIN) {
+        std::cerr << "io_uring_enter() failed: " << std::strerror(errno) << "\n";
       }
+      return false;
+    }
+    submitted_tail_ += static_cast<unsigned>(n);
+    return true;
+  }
 
-      // If the socket has data, read some bytes and print full lines as they arrive
-      if (FD_ISSET(socket_fd, &read_set)) {
-        char chunk[4096];
-        ssize_t n = ::recv(socket_fd, chunk, sizeof(chunk), 0);
-        if (n == 0) {
-          std::cout << "peer disconnected\n";
-          break;
-        }
-        if (n < 0) {
-          if (errno == EINTR) continue;
-          std::cerr << "recv() failed: " << std::strerror(errno) << "\n";
-          break;
-        }
+  // backlogged: completions were set aside while the SQ was full (see
+  // get_sqe); reap() must run even if the ring fd doesn't wake us
+  bool backlogged() const { return !backlog_.empty(); }
 
-        // Append these bytes to our buffer
-        incoming_buffer.append(chunk, static_cast<size_t>(n));
+  // flush: before exiting, wait until every queued send has completed
+  void flush() {
+    while (sends_inflight_ > 0) {
+      submit();
+      if (sys_io_uring_enter(ring_fd_, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) return;
+      reap();
+    }
+  }
 
-        // Pull out complete lines (messages end with '\n')
-        while (true) {
-          size_t pos = incoming_buffer.find('\n');
-          if (pos == std::string::npos) break;
-          std::string one_line = incoming_buffer.substr(0, pos);
-          incoming_buffer.erase(0, pos + 1);
-          std::cout << "[peer] " << one_line << "\n";
-        }
+  // reap: handle every completion the kernel has posted, including those
+  // on its overflow list. Completions are handled strictly in order:
+  // set-aside ones first, since they are older than what is in the CQ.
+  void reap() {
+    while (true) {
+      io_uring_cqe cqe;
+      if (!backlog_.empty()) {
+        cqe = backlog_.front();
+        backlog_.pop_front();
+      } else if (!take_cqe(&cqe)) {
+        if (!overflowed()) return;
+        flush_overflow();
+        continue;
       }
+      // A handler may queue a send, which may set CQEs aside (get_sqe),
+      // so nothing about the CQ is cached across this call
+      if ((cqe.user_data >> 56) == kRecv) handle_recv(cqe);
+      else handle_send(cqe);
     }
+  }
+
+ private:
+  static constexpr unsigned kEntries = 256;          // SQ size
+  static constexpr size_t kMaxCqEntries = 65536;
+  static constexpr size_t kMinBuffers = 256;         // buffer counts are powers of two
+  static constexpr size_t kMaxBuffers = 4096;        // 16 MiB at kBufferSize
+  static constexpr unsigned kBufferSize = 4096;
+  static constexpr uint16_t kBufferGroup = 0;
+  static constexpr uint64_t kRecv = 1;
+  static constexpr uint64_t kSend = 2;
+  static constexpr uint32_t kGenMask = 0xffffff;
+
+  // Slot: per-fd state. `gen` changes whenever the fd number is reused, so a
+  // late completion for an old connection can't be mistaken for a new one.
+  struct Slot {
+    bool active = false;
+    uint32_t gen = 0;
+    bool send_inflight = false;
+    std::vector<char> inflight;  // owned by the kernel until the send CQE
+    size_t inflight_offset = 0;
+    std::vector<char> pending;   // queued while a send is in flight
+    SendStats stats;
+  };
 
-    ::close(socket_fd);
-    return 0;
+  // user_data layout: [op:8][gen:24][fd:32]
+  static uint64_t user_data(uint64_t op, int fd, uint32_t gen) {
+    return (op << 56) | (static_cast<uint64_t>(gen & kGenMask) << 32) | static_cast<uint32_t>(fd);
   }
-  else if (argc >= 4 && std::string(argv[1]) == "--connect") {
-    std::string host = argv[2];
-    int port = std::stoi(argv[3]);
-    int socket_fd = connect_to_peer(host, port);
-    if (socket_fd < 0) return 1;
 
-    std::cout << "connected to " << host << ":" << port << "\n";
-    std::cout << "type a message and press Enter to send; Ctrl+D to quit\n";
+  Slot& slot_for(int fd) {
+    if (static_cast<size_t>(fd) >= slots_.size()) slots_.resize(fd + 1);
+    return slots_[fd];
+  }
 
-    std::string incoming_buffer;
+  // get_sqe: next free submission entry (submitting early if the ring is full)
+  io_uring_sqe* get_sqe() {
+    while (sq_local_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      if (submit()) continue;
+      // The kernel won't take more until the CQ has room. We may be inside
+      // reap(), so don't run handlers here: set the completions aside for
+      // reap() to handle in order, and let the overflow back in.
+      io_uring_cqe cqe;
+      while (take_cqe(&cqe)) backlog_.push_back(cqe);
+      flush_overflow();
+    }
+    unsigned index = sq_local_tail_ & sq_mask_;
+    io_uring_sqe* sqe = &sqes_[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    ++sq_local_tail_;
+    return sqe;
+  }
 
-    while (true) {
-      fd_set read_set;
-      FD_ZERO(&read_set);
-      FD_SET(0, &read_set);
-      FD_SET(socket_fd, &read_set);
+  void arm_recv(int fd, const Slot& slot) {
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = kBufferGroup;
+    sqe->user_data = user_data(kRecv, fd, slot.gen);
+  }
 
-      int max_fd = (socket_fd > 0 ? socket_fd : 0);
-      int ready = ::select(max_fd + 1, &read_set, nullptr, nullptr, nullptr);
-      if (ready < 0) {
-        if (errno == EINTR) continue;
-        std::cerr << "select() failed: " << std::strerror(errno) << "\n";
-        break;
+  void start_send(int fd, Slot& slot) {
+    if (slot.inflight_offset >= slot.inflight.size()) {
+      if (slot.pending.empty()) return;
+      slot.inflight.swap(slot.pending);
+      slot.pending.clear();
+      slot.inflight_offset = 0;
+    }
+    io_uring_sqe* sqe = get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(slot.inflight.data() + slot.inflight_offset);
+    sqe->len = static_cast<uint32_t>(slot.inflight.size() - slot.inflight_offset);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = user_data(kSend, fd, slot.gen);
+    ++slot.stats.calls;
+    slot.send_inflight = true;
+    ++sends_inflight_;
+  }
+
+  // take_cqe: pop the oldest completion off the CQ, if there is one
+  bool take_cqe(io_uring_cqe* cqe) {
+    unsigned head = *cq_head_;
+    if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) return false;
+    *cqe = cqes_[head & cq_mask_];
+    __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+    return true;
+  }
+
+  // overflowed: the kernel is holding completions that didn't fit the CQ
+  bool overflowed() const {
+    return __atomic_load_n(sq_flags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW;
+  }
+
+  // flush_overflow: have the kernel move overflowed completions into the CQ
+  void flush_overflow() { sys_io_uring_enter(ring_fd_, 0, 0, IORING_ENTER_GETEVENTS); }
+
+  // put_buffer: give buffer `bid` back to the kernel
+  void put_buffer(uint16_t bid) {
+    // Index from the ring base, not ->bufs: in C++ the header's flexible
+    // array wrapper adds a padding byte and shifts bufs[] by 8 bytes.
+    io_uring_buf* bufs = reinterpret_cast<io_uring_buf*>(buf_ring_);
+    io_uring_buf* buf = &bufs[buf_tail_ & (buffer_count_ - 1)];
+    buf->addr = reinterpret_cast<uint64_t>(buffers_.data() + static_cast<size_t>(bid) * kBufferSize);
+    buf->len = kBufferSize;
+    buf->bid = bid;
+    ++buf_tail_;
+    __atomic_store_n(&buf_ring_->tail, buf_tail_, __ATOMIC_RELEASE);
+  }
+
+  void handle_recv(const io_uring_cqe& cqe) {
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+    uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32) & kGenMask;
+    Slot& slot = slot_for(fd);
+    bool current = slot.active && slot.gen == gen;
+
+    if (cqe.flags & IORING_CQE_F_BUFFER) {
+      uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+      if (current && cqe.res > 0) {
+        on_recv_(fd, buffers_.data() + static_cast<size_t>(bid) * kBufferSize,
+                 static_cast<size_t>(cqe.res));
+      }
+      put_buffer(bid);
+    }
+    if (cqe.flags & IORING_CQE_F_MORE) return; // still armed
+
+    // The multishot recv ended. The callback above may have closed the fd.
+    Slot& now = slot_for(fd);
+    if (!now.active || now.gen != gen) return;
+    if (cqe.res > 0 || cqe.res == -ENOBUFS || cqe.res == -EINTR) {
+      arm_recv(fd, now); // ran out of buffers or CQ space: just re-arm
+    } else {
+      on_close_(fd, cqe.res);
+    }
+  }
+
+  void handle_send(const io_uring_cqe& cqe) {
+    int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+    uint32_t gen = static_cast<uint32_t>(cqe.user_data >> 32) & kGenMask;
+    Slot& slot = slot_for(fd);
+    if (!slot.active || slot.gen != gen) {
+      orphaned_sends_.erase(cqe.user_data);
+      return;
+    }
+    slot.send_inflight = false;
+    --sends_inflight_;
+    if (cqe.res < 0) {
+      on_close_(fd, cqe.res);
+      return;
+    }
+    slot.inflight_offset += static_cast<size_t>(cqe.res); // TCP may send a prefix
+    slot.stats.bytes += static_cast<uint64_t>(cqe.res);
+    if (slot.inflight_offset < slot.inflight.size()) ++slot.stats.partial;
+    start_send(fd, slot);
+  }
+
+  RecvCallback on_recv_;
+  CloseCallback on_close_;
+
+  int ring_fd_ = -1;
+  void* sq_ptr_ = nullptr;
+  void* cq_ptr_ = nullptr;
+  size_t sq_bytes_ = 0;
+  size_t cq_bytes_ = 0;
+  io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_bytes_ = 0;
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_flags_ = nullptr;  // IORING_SQ_CQ_OVERFLOW lives here
+  unsigned* sq_array_ = nullptr;
+  unsigned sq_mask_ = 0;
+  unsigned sq_entries_ = 0;
+  unsigned sq_local_tail_ = 0;  // SQEs we have prepared
+  unsigned submitted_tail_ = 0; // SQEs the kernel has accepted
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  io_uring_cqe* cqes_ = nullptr;
+  std::deque<io_uring_cqe> backlog_; // taken off a full CQ, not yet handled
+
+  io_uring_buf_ring* buf_ring_ = nullptr;
+  size_t buf_ring_bytes_ = 0;
+  uint16_t buf_tail_ = 0;
+  uint16_t buffer_count_ = 0;
+  std::vector<char> buffers_;
+
+  std::vector<Slot> slots_; // indexed by fd
+  uint32_t next_gen_ = 1;
+  size_t sends_inflight_ = 0;
+  std::unordered_map<uint64_t, std::vector<char>> orphaned_sends_;
+};
+
+// -------------- options --------------
+
+// Endpoint: one peer address we may dial
+struct Endpoint {
+  std::string host;
+  int port = 0;
+};
+
+// Options: everything we read from the command line.
+// --listen and --connect may be combined: one process is then a full node.
+struct Options {
+  int listen_port = -1;           // --listen PORT (-1 = don't listen)
+  std::vector<Endpoint> connect_to; // --connect HOST PORT (may repeat): candidates
+  int connect_timeout_ms = 5000;  // --connect-timeout MS
+  int outbound = 0;               // --outbound N: peers to maintain (0 = all)
+  std::string engine = "epoll";   // --engine=epoll|uring
+  std::string framing = "line";   // --framing=line|bitcoin
+  int threads = 1;                // --threads N (listen mode; 0 = one per core)
+  size_t send_high_water = 4 << 20; // --send-hwm BYTES: most we queue for one peer
+  int coalesce_ms = 0;            // --coalesce-ms MS: hold small sends up to MS
+  size_t coalesce_bytes = 64 << 10; // --coalesce-bytes BYTES: ... or until this much is queued
+  size_t zerocopy_min = 0;        // --zerocopy-min BYTES: MSG_ZEROCOPY from this size (0 = off)
+  std::string send_file;          // --send-file PATH: stream this file to each peer
+  std::string recv_file;          // --recv-file PATH: write what each peer sends here
+  std::string output = "stdout";  // --output=stdout|null|count|file:PATH
+  bool quiet = false;             // --quiet: no line per peer connecting/leaving
+  int stats_ms = 0;               // --stats-ms MS: print per-peer stats every MS (0 = off)
+  int tcp_info_ms = 1000;         // --tcp-info-ms MS: sample TCP_INFO every MS (0 = off)
+  int slow_peer_ms = 0;           // --slow-peer-ms MS: drop peers MS behind (0 = off)
+  int metrics_port = -1;          // --metrics-port PORT: serve Prometheus metrics (-1 = off)
+  bool bench_tx = false;          // --bench-tx: send generated messages, then report
+  bool bench_rx = false;          // --bench-rx: count received messages and report
+  size_t bench_size = 64;         // --bench-size BYTES: payload of each message
+  size_t bench_count = 1000000;   // --bench-count N: messages --bench-tx sends
+  bool bench_framing = false;     // --bench-framing: time framing in-process, then exit
+  size_t bench_churn = 0;         // --bench-churn N: connections to open and close (0 = off)
+  size_t churn_parallel = 32;     // --churn-parallel N: ... at a time
+  size_t bench_fanout = 0;        // --bench-fanout N: broadcast to 1..N subscribers, then exit
+  size_t fanout_rounds = 1000;    // --fanout-rounds R: broadcasts per subscriber count
+  bool ping = false;              // --ping: measure round trips to the first peer
+  bool echo = false;              // --echo: answer --ping probes
+  size_t ping_count = 100000;     // --ping-count N: probes before reporting totals
+  int report_ms = 1000;           // --report-ms MS: latency report interval
+
+  // reads_stdin: are lines typed on stdin sent to peers?
+  bool reads_stdin() const {
+    return send_file.empty() && recv_file.empty() && !bench_tx && !bench_rx && bench_churn == 0 &&
+           !ping && !echo;
+  }
+};
+
+// parse_options: very simple argument handling.
+// Flags take a value either as "--flag=value" or "--flag value".
+// parse_number: text as a whole decimal integer within [min, max].
+// Anything else (junk, a sign where none fits, out of range) is reported
+// against the flag and fails, so the caller shows the usage.
+template <typename T>
+static bool parse_number(const std::string& flag, const std::string& text, T min, T max, T* out) {
+  T value{};
+  const char* end = text.data() + text.size();
+  auto [stop, error] = std::from_chars(text.data(), end, value);
+  if (text.empty() || error != std::errc() || stop != end || value < min || value > max) {
+    std::cerr << "bad value for " << flag << ": \"" << text << "\" (want " << min << " to " << max
+              << ")\n";
+    return false;
+  }
+  *out = value;
+  return true;
+}
+
+static bool parse_options(int argc, char** argv, Options* opt) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    std::string inline_value;
+    bool has_inline_value = false;
+    size_t eq = arg.find('=');
+    if (arg.rfind("--", 0) == 0 && eq != std::string::npos) {
+      inline_value = arg.substr(eq + 1);
+      arg = arg.substr(0, eq);
+      has_inline_value = true;
+    }
+    // next_value: the flag's value, from "=value" or the next argument
+    auto next_value = [&](std::string* out) {
+      if (has_inline_value) {
+        *out = inline_value;
+        has_inline_value = false;
+        return true;
       }
+      if (i + 1 >= argc) return false;
+      *out = argv[++i];
+      return true;
+    };
 
-      if (FD_ISSET(0, &read_set)) {
-        std::string line;
-        if (!std::getline(std::cin, line)) {
-          std::cout << "stdin closed; goodbye\n";
-          break;
-        }
-        line.push_back('\n');
-        if (!send_all_bytes(socket_fd, line)) {
-          std::cerr << "failed to send to peer\n";
-          break;
-        }
+    // number: the flag's value, checked into *out
+    auto number = [&]<typename T>(T* out, std::type_identity_t<T> min,
+                                  std::type_identity_t<T> max) {
+      std::string text;
+      if (!next_value(&text)) return false;
+      return parse_number(arg, text, min, max, out);
+    };
+    constexpr int kMaxInt = std::numeric_limits<int>::max();
+    constexpr size_t kMaxSize = std::numeric_limits<size_t>::max();
+
+    if (arg == "--listen") {
+      if (!number(&opt->listen_port, 0, 65535)) return false;
+    } else if (arg == "--connect") {
+      Endpoint peer;
+      if (!next_value(&peer.host) || i + 1 >= argc) return false;
+      if (!parse_number<int>(arg, argv[++i], 1, 65535, &peer.port)) return false;
+      opt->connect_to.push_back(peer);
+    } else if (arg == "--connect-timeout") {
+      if (!number(&opt->connect_timeout_ms, 1, kMaxInt)) return false;
+    } else if (arg == "--outbound") {
+      if (!number(&opt->outbound, 0, kMaxInt)) return false;
+    } else if (arg == "--threads") {
+      if (!number(&opt->threads, 0, 1024)) return false;
+    } else if (arg == "--send-hwm") {
+      if (!number(&opt->send_high_water, 1, kMaxSize)) return false;
+    } else if (arg == "--coalesce-ms") {
+      if (!number(&opt->coalesce_ms, 0, kMaxInt)) return false;
+    } else if (arg == "--coalesce-bytes") {
+      if (!number(&opt->coalesce_bytes, 0, kMaxSize)) return false;
+    } else if (arg == "--zerocopy-min") {
+      if (!number(&opt->zerocopy_min, 0, kMaxSize)) return false;
+    } else if (arg == "--send-file") {
+      if (!next_value(&opt->send_file)) return false;
+    } else if (arg == "--recv-file") {
+      if (!next_value(&opt->recv_file)) return false;
+    } else if (arg == "--bench-tx") {
+      opt->bench_tx = true;
+    } else if (arg == "--bench-rx") {
+      opt->bench_rx = true;
+    } else if (arg == "--bench-size") {
+      if (!number(&opt->bench_size, 0, 32 << 20)) return false; // a bitcoin payload's limit
+    } else if (arg == "--bench-count") {
+      if (!number(&opt->bench_count, 1, kMaxSize)) return false;
+    } else if (arg == "--bench-framing") {
+      opt->bench_framing = true;
+    } else if (arg == "--bench-churn") {
+      if (!number(&opt->bench_churn, 0, kMaxSize)) return false;
+    } else if (arg == "--churn-parallel") {
+      if (!number(&opt->churn_parallel, 1, 65536)) return false;
+    } else if (arg == "--bench-fanout") {
+      if (!number(&opt->bench_fanout, 0, 1 << 20)) return false;
+    } else if (arg == "--fanout-rounds") {
+      if (!number(&opt->fanout_rounds, 1, kMaxSize)) return false;
+    } else if (arg == "--stats-ms") {
+      if (!number(&opt->stats_ms, 0, kMaxInt)) return false;
+    } else if (arg == "--tcp-info-ms") {
+      if (!number(&opt->tcp_info_ms, 0, kMaxInt)) return false;
+    } else if (arg == "--slow-peer-ms") {
+      if (!number(&opt->slow_peer_ms, 0, kMaxInt)) return false;
+    } else if (arg == "--metrics-port") {
+      if (!number(&opt->metrics_port, 0, 65535)) return false;
+    } else if (arg == "--quiet") {
+      opt->quiet = true;
+    } else if (arg == "--ping") {
+      opt->ping = true;
+    } else if (arg == "--echo") {
+      opt->echo = true;
+    } else if (arg == "--ping-count") {
+      if (!number(&opt->ping_count, 1, kMaxSize)) return false;
+    } else if (arg == "--report-ms") {
+      if (!number(&opt->report_ms, 1, kMaxInt)) return false;
+    } else if (arg == "--output") {
+      if (!next_value(&opt->output)) return false;
+    } else if (arg == "--framing") {
+      if (!next_value(&opt->framing)) return false;
+      if (opt->framing != "line" && opt->framing != "bitcoin") return false;
+    } else if (arg == "--engine") {
+      if (!next_value(&opt->engine)) return false;
+      if (opt->engine != "epoll" && opt->engine != "uring") return false;
+    } else {
+      std::cerr << "unknown option: " << arg << "\n";
+      return false;
+    }
+  }
+  if (!opt->send_file.empty() && !opt->recv_file.empty()) return false; // one direction
+  if (opt->bench_churn > 0 && opt->connect_to.empty()) return false;    // churn what?
+  if (opt->slow_peer_ms > 0 && opt->tcp_info_ms == 0) return false;     // needs the samples
+  return opt->bench_framing || opt->bench_fanout > 0 || opt->listen_port >= 0 ||
+         !opt->connect_to.empty();
+}
+
+// -------------- receive buffer --------------
+
+// RecvBuffer: bytes received but not yet framed, in one contiguous block.
+//
+//   buf_:  [ consumed | unread bytes ........ | free space ]
+//                     ^begin_                 ^end_
+//
+// Taking a message off the front only advances begin_, so framing N
+// messages out of one recv() costs no copying. The unread tail is moved to
+// the front at most once per recv (in prepare), and only when the free
+// space at the end is too small.
+class RecvBuffer {
+ public:
+  // prepare: pointer to at least `want` free bytes after the unread data
+  char* prepare(size_t want) {
+    if (buf_.size() - end_ < want) {
+      if (begin_ > 0) {
+        std::memmove(buf_.data(), buf_.data() + begin_, end_ - begin_);
+        end_ -= begin_;
+        begin_ = 0;
       }
+      if (buf_.size() - end_ < want) buf_.resize(std::max(buf_.size() * 2, end_ + want));
+    }
+    return buf_.data() + end_;
+  }
 
-      if (FD_ISSET(socket_fd, &read_set)) {
-        char chunk[4096];
-        ssize_t n = ::recv(socket_fd, chunk, sizeof(chunk), 0);
-        if (n == 0) {
-          std::cout << "peer disconnected\n";
-          break;
-        }
-        if (n < 0) {
-          if (errno == EINTR) continue;
-          std::cerr << "recv() failed: " << std::strerror(errno) << "\n";
-          break;
+  // commit: n bytes were written at prepare()'s pointer
+  void commit(size_t n) { end_ += n; }
+
+  void append(const char* data, size_t len) {
+    std::memcpy(prepare(len), data, len);
+    commit(len);
+  }
+
+  const char* data() const { return buf_.data() + begin_; }
+  size_t capacity() const { return buf_.size(); } // memory held, used or not
+  size_t size() const { return end_ - begin_; }
+
+  // consume: drop n bytes from the front (a message that was handled)
+  void consume(size_t n) {
+    begin_ += n;
+    if (begin_ == end_) begin_ = end_ = 0; // empty: start over at the front
+  }
+
+  void clear() { begin_ = end_ = 0; }
+
+ private:
+  std::vector<char> buf_;
+  size_t begin_ = 0;
+  size_t end_ = 0;
+};
+
+// -------------- send queue --------------
+
+// SendQueue: framed messages waiting to go out to one peer.
+// Messages are shared, so a broadcast queues the same bytes for every peer
+// without copying them. flush() gathers queued messages into one
+// sendmsg() iovec batch (up to kMaxIov messages / kMaxBatchBytes), so many
+// small messages cost one system call and fill whole TCP segments. It
+// stops when the socket is full; the rest waits for EPOLLOUT.
+//
+// With enable_zerocopy(), messages of at least min_bytes go out alone
+// with MSG_ZEROCOPY: the kernel sends straight from our buffer instead of
+// copying it. The buffer must then stay untouched until the kernel says
+// it is done (a notification on the socket's error queue, read by
+// reap_zerocopy), so each such message is held in zerocopy_inflight_
+// under the kernel's sequence number for that send.
+class SendQueue {
+ public:
+  using Chunk = std::shared_ptr<const std::string>;
+
+  void push(Chunk chunk) {
+    bytes_ += chunk->size();
+    chunks_.push_back(std::move(chunk));
+  }
+
+  size_t bytes() const { return bytes_; } // queued and not yet sent
+  bool empty() const { return chunks_.empty(); }
+  // idle: nothing queued and no buffer still lent to the kernel
+  bool idle() const { return chunks_.empty() && zerocopy_inflight_.empty(); }
+  size_t zerocopy_inflight() const { return zerocopy_inflight_.size(); }
+
+  // enable_zerocopy: the socket has SO_ZEROCOPY set; use it from min_bytes
+  void enable_zerocopy(size_t min_bytes) { zerocopy_min_ = min_bytes; }
+
+  // flush: send until the queue is empty or the socket would block.
+  // Returns false on a socket error (errno says which).
+  bool flush(int fd) {
+    bool allow_zerocopy = true;
+    while (!chunks_.empty()) {
+      bool zerocopy = allow_zerocopy && is_large(chunks_.front()->size() - offset_);
+      iovec iov[kMaxIov];
+      size_t count = 0;
+      size_t batch = 0;
+      for (size_t i = 0; i < chunks_.size() && count < kMaxIov && batch < kMaxBatchBytes; ++i) {
+        if (i > 0 && (zerocopy || is_large(chunks_[i]->size()))) break; // large ones go alone
+        size_t skip = (i == 0) ? offset_ : 0;
+        iov[count].iov_base = const_cast<char*>(chunks_[i]->data() + skip);
+        iov[count].iov_len = chunks_[i]->size() - skip;
+        batch += iov[count].iov_len;
+        ++count;
+      }
+      msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      // MSG_MORE while another batch follows: the kernel holds a partial
+      // segment back instead of pushing it out on its own (like TCP_CORK,
+      // without two extra setsockopt() calls per flush)
+      int flags = MSG_NOSIGNAL | MSG_DONTWAIT | (batch < bytes_ ? MSG_MORE : 0);
+      if (zerocopy) flags |= MSG_ZEROCOPY;
+      ssize_t n = ::sendmsg(fd, &msg, flags);
+      ++syscall_count;
+      ++stats_.calls;
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (zerocopy && errno == ENOBUFS) {
+          allow_zerocopy = false; // too many buffers pinned already: copy this time
+          continue;
         }
+        return errno == EAGAIN || errno == EWOULDBLOCK; // full: try again on EPOLLOUT
+      }
+      if (zerocopy) zerocopy_inflight_.push_back({zerocopy_next_id_++, chunks_.front()});
+      consume(static_cast<size_t>(n));
+      stats_.bytes += static_cast<uint64_t>(n);
+      if (static_cast<size_t>(n) < batch) {
+        ++stats_.partial;
+        return true; // took a prefix: the socket is full
+      }
+    }
+    return true;
+  }
 
-        incoming_buffer.append(chunk, static_cast<size_t>(n));
-        while (true) {
-          size_t pos = incoming_buffer.find('\n');
-          if (pos == std::string::npos) break;
-          std::string one_line = incoming_buffer.substr(0, pos);
-          incoming_buffer.erase(0, pos + 1);
-          std::cout << "[peer] " << one_line << "\n";
+  // reap_zerocopy: read MSG_ZEROCOPY completions from the error queue and
+  // release the messages the kernel no longer needs
+  void reap_zerocopy(int fd) {
+    while (!zerocopy_inflight_.empty()) {
+      char control[128];
+      msghdr msg;
+      std::memset(&msg, 0, sizeof(msg));
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      ++syscall_count;
+      if (::recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) return; // none left
+      for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+            !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+          continue;
         }
+        sock_extended_err err;
+        std::memcpy(&err, CMSG_DATA(cm), sizeof(err));
+        if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) continue;
+        // The notification covers sends ee_info..ee_data (inclusive)
+        uint32_t first = err.ee_info;
+        uint32_t span = err.ee_data - first;
+        zerocopy_inflight_.erase(
+            std::remove_if(zerocopy_inflight_.begin(), zerocopy_inflight_.end(),
+                           [&](const ZerocopySend& send) { return send.id - first <= span; }),
+            zerocopy_inflight_.end());
+        // The kernel had to copy after all (loopback always does): pinning
+        // the pages only costs us, so send this peer's messages normally
+        if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zerocopy_min_ = 0;
+      }
+    }
+  }
+
+  const SendStats& stats() const { return stats_; }
+
+  void clear() {
+    chunks_.clear();
+    offset_ = 0;
+    bytes_ = 0;
+    stats_ = SendStats();
+    zerocopy_inflight_.clear();
+    zerocopy_next_id_ = 0;
+    zerocopy_min_ = 0;
+  }
+
+ private:
+  static constexpr size_t kMaxIov = 64;
+  static constexpr size_t kMaxBatchBytes = 256 * 1024;
+
+  // ZerocopySend: a message the kernel may still be reading
+  struct ZerocopySend {
+    uint32_t id; // the socket counts MSG_ZEROCOPY sends from 0
+    Chunk chunk;
+  };
+
+  bool is_large(size_t len) const { return zerocopy_min_ > 0 && len >= zerocopy_min_; }
+
+  // consume: drop n sent bytes from the front of the queue
+  void consume(size_t n) {
+    bytes_ -= n;
+    while (n > 0) {
+      size_t left = chunks_.front()->size() - offset_;
+      if (n < left) {
+        offset_ += n;
+        return;
+      }
+      n -= left;
+      chunks_.pop_front();
+      offset_ = 0;
+    }
+    // Empty messages (if any) at the front are "sent" too
+    while (!chunks_.empty() && chunks_.front()->size() == offset_) {
+      chunks_.pop_front();
+      offset_ = 0;
+    }
+  }
+
+  std::deque<Chunk> chunks_;
+  size_t offset_ = 0; // bytes of the front chunk already sent
+  size_t bytes_ = 0;
+  size_t zerocopy_min_ = 0; // 0: never
+  uint32_t zerocopy_next_id_ = 0;
+  std::deque<ZerocopySend> zerocopy_inflight_;
+  SendStats stats_;
+};
+
+// -------------- delimiter scanning --------------
+
+// scan_delimiters: append the offset of every `delim` in data[0..len) to
+// *out, in one pass. The SIMD versions compare 16 or 32 bytes at a time and
+// turn the matches into a bitmask, so a chunk full of tiny messages costs
+// about one compare per 32 bytes instead of one memchr() call per message.
+// The best version for this CPU is picked once, at startup.
+using ScanFn = void (*)(const char* data, size_t len, char delim, std::vector<size_t>* out);
+
+// scan_bytes: the plain byte-at-a-time loop, from offset `from`
+static inline void scan_bytes(const char* data, size_t from, size_t len, char delim,
+                              std::vector<size_t>* out) {
+  for (size_t i = from; i < len; ++i) {
+    if (data[i] == delim) out->push_back(i);
+  }
+}
+
+static void scan_delimiters_scalar(const char* data, size_t len, char delim,
+                                   std::vector<size_t>* out) {
+  scan_bytes(data, 0, len, delim, out);
+}
+
+#if defined(__x86_64__)
+// push_mask_bits: one offset per set bit of a compare mask
+static inline void push_mask_bits(uint32_t mask, size_t base, std::vector<size_t>* out) {
+  while (mask != 0) {
+    out->push_back(base + static_cast<size_t>(__builtin_ctz(mask)));
+    mask &= mask - 1; // clear the lowest set bit
+  }
+}
+
+static void scan_delimiters_sse2(const char* data, size_t len, char delim,
+                                 std::vector<size_t>* out) {
+  const __m128i needle = _mm_set1_epi8(delim);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+    uint32_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle)));
+    push_mask_bits(mask, i, out);
+  }
+  scan_bytes(data, i, len, delim, out); // the last few bytes
+}
+
+__attribute__((target("avx2")))
+static void scan_delimiters_avx2(const char* data, size_t len, char delim,
+                                 std::vector<size_t>* out) {
+  const __m256i needle = _mm256_set1_epi8(delim);
+  size_t i = 0;
+  // 128 bytes per step with one test for "any match": long messages are
+  // skipped as fast as memchr() does, and only blocks with a delimiter
+  // pay for turning matches into offsets
+  for (; i + 128 <= len; i += 128) {
+    const __m256i* block = reinterpret_cast<const __m256i*>(data + i);
+    __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256(block), needle);
+    __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256(block + 1), needle);
+    __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256(block + 2), needle);
+    __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256(block + 3), needle);
+    __m256i any = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+    if (_mm256_testz_si256(any, any)) continue;
+    push_mask_bits(static_cast<uint32_t>(_mm256_movemask_epi8(a)), i, out);
+    push_mask_bits(static_cast<uint32_t>(_mm256_movemask_epi8(b)), i + 32, out);
+    push_mask_bits(static_cast<uint32_t>(_mm256_movemask_epi8(c)), i + 64, out);
+    push_mask_bits(static_cast<uint32_t>(_mm256_movemask_epi8(d)), i + 96, out);
+  }
+  for (; i + 32 <= len; i += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, needle)));
+    push_mask_bits(mask, i, out);
+  }
+  if (i < len && len >= 32) {
+    // The last few bytes: one more load ending at len, minus the bytes
+    // already scanned, instead of a byte loop
+    size_t last = len - 32;
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + last));
+    uint32_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, needle)));
+    push_mask_bits(mask & (~uint32_t{0} << (i - last)), last, out);
+    return;
+  }
+  scan_bytes(data, i, len, delim, out);
+}
+#endif
+
+// pick_scanner: the fastest scan_delimiters this CPU supports
+static ScanFn pick_scanner() {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) return scan_delimiters_avx2;
+  return scan_delimiters_sse2; // every x86-64 CPU has SSE2
+#else
+  return scan_delimiters_scalar;
+#endif
+}
+
+static const ScanFn scan_delimiters = pick_scanner();
+
+// -------------- sha256 --------------
+
+// A small SHA-256 (FIPS 180-4), enough for Bitcoin's message checksum:
+// the first 4 bytes of SHA256(SHA256(payload)). Checksums are the biggest
+// per-byte cost of bitcoin framing, so there are three compression
+// functions: SHA-NI (the CPU's own SHA instructions), AVX2 (8 messages at
+// once, one per 32-bit lane) and plain C++. Like scan_delimiters, the
+// choice is made once at startup.
+static const uint32_t kSha256K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2};
+
+static const uint32_t kSha256Init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+static inline uint32_t rotr32(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+static inline uint32_t read_be32(const uint8_t* p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static inline void write_be32(uint8_t* p, uint32_t v) {
+  p[0] = uint8_t(v >> 24);
+  p[1] = uint8_t(v >> 16);
+  p[2] = uint8_t(v >> 8);
+  p[3] = uint8_t(v);
+}
+
+// Sha256TransformFn: run the compression function over `blocks` 64-byte blocks
+using Sha256TransformFn = void (*)(uint32_t state[8], const uint8_t* data, size_t blocks);
+
+static void sha256_transform_scalar(uint32_t state[8], const uint8_t* data, size_t blocks) {
+  for (; blocks > 0; --blocks, data += 64) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) w[i] = read_be32(data + 4 * i);
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) +
+                    kSha256K[i] + w[i];
+      uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+  }
+}
+
+#if defined(__x86_64__)
+// sha256_transform_shani: the SHA extensions do two rounds per
+// sha256rnds2, with the state split into ABEF and CDGH halves, and
+// sha256msg1/msg2 expand the message schedule four words at a time.
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(uint32_t state[8], const uint8_t* data, size_t blocks) {
+  const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i dcba = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state));
+  __m128i hgfe = _mm_loadu_si128(reinterpret_cast<const __m128i*>(state + 4));
+  __m128i cdab = _mm_shuffle_epi32(dcba, 0xb1);
+  __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1b);
+  __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+  __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xf0);
+
+  for (; blocks > 0; --blocks, data += 64) {
+    const __m128i abef_start = abef;
+    const __m128i cdgh_start = cdgh;
+    __m128i w[4]; // the last 16 schedule words, four per register
+#pragma GCC unroll 16
+    for (int q = 0; q < 16; ++q) { // 16 groups of 4 rounds
+      __m128i& words = w[q & 3];
+      if (q < 4) {
+        words = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * q));
+        words = _mm_shuffle_epi8(words, byte_swap);
+      } else {
+        // W[t] = W[t-16] + s0(W[t-15]) + W[t-7] + s1(W[t-2])
+        __m128i t7 = _mm_alignr_epi8(w[(q + 3) & 3], w[(q + 2) & 3], 4);
+        words = _mm_add_epi32(_mm_sha256msg1_epu32(words, w[(q + 1) & 3]), t7);
+        words = _mm_sha256msg2_epu32(words, w[(q + 3) & 3]);
       }
+      __m128i k = _mm_add_epi32(words, _mm_loadu_si128(reinterpret_cast<const __m128i*>(kSha256K + 4 * q)));
+      cdgh = _mm_sha256rnds2_epu32(cdgh, abef, k);
+      abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(k, 0x0e));
     }
+    abef = _mm_add_epi32(abef, abef_start);
+    cdgh = _mm_add_epi32(cdgh, cdgh_start);
+  }
+
+  __m128i feba = _mm_shuffle_epi32(abef, 0x1b);
+  __m128i dchg = _mm_shuffle_epi32(cdgh, 0xb1);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state), _mm_blend_epi16(feba, dchg, 0xf0));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+// cpu_has_sha: CPUID leaf 7 says SHA, leaf 1 says SSE4.1
+static bool cpu_has_sha() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSE4_1)) return false;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+  return (ebx & bit_SHA) != 0;
+}
+#endif
+
+// pick_sha256_transform: the fastest single-message transform for this CPU
+static Sha256TransformFn pick_sha256_transform() {
+#if defined(__x86_64__)
+  if (cpu_has_sha()) return sha256_transform_shani;
+#endif
+  return sha256_transform_scalar;
+}
+
+static const Sha256TransformFn sha256_transform = pick_sha256_transform();
+
+// sha256_pad: the last partial block of a len-byte message plus the
+// padding (0x80, zeros, then the bit length as a 64-bit big-endian
+// number). `rest` is the partial block; returns how many blocks (1 or 2)
+// of `tail` to hash after the full ones.
+static size_t sha256_pad(const uint8_t* rest, size_t len, uint8_t tail[128]) {
+  size_t rest_len = len % 64;
+  std::memset(tail, 0, 128);
+  std::memcpy(tail, rest, rest_len);
+  tail[rest_len] = 0x80;
+  size_t tail_blocks = (rest_len + 9 <= 64) ? 1 : 2;
+  uint64_t bits = static_cast<uint64_t>(len) * 8;
+  write_be32(tail + tail_blocks * 64 - 8, static_cast<uint32_t>(bits >> 32));
+  write_be32(tail + tail_blocks * 64 - 4, static_cast<uint32_t>(bits));
+  return tail_blocks;
+}
+
+// sha256: hash len bytes into out[32]
+static void sha256(const uint8_t* data, size_t len, uint8_t out[32]) {
+  uint32_t state[8];
+  std::memcpy(state, kSha256Init, sizeof(state));
+  size_t full = len / 64;
+  sha256_transform(state, data, full);
+  uint8_t tail[128];
+  size_t tail_blocks = sha256_pad(data + full * 64, len, tail);
+  sha256_transform(state, tail, tail_blocks);
+  for (int i = 0; i < 8; ++i) write_be32(out + 4 * i, state[i]);
+}
+
+// bitcoin_checksum: first 4 bytes of SHA256(SHA256(payload))
+static void bitcoin_checksum(const uint8_t* payload, size_t len, uint8_t out[4]) {
+  uint8_t first[32], second[32];
+  sha256(payload, len, first);
+  sha256(first, sizeof(first), second);
+  std::memcpy(out, second, 4);
+}
+
+// ChecksumJob: one received payload and the checksum its header claims
+struct ChecksumJob {
+  const uint8_t* payload = nullptr;
+  size_t len = 0;
+  const uint8_t* expected = nullptr; // 4 bytes
+  bool ok = false;                   // set by verify_checksums
+};
+
+// verify_checksums_one_by_one: bitcoin_checksum for each job in turn
+static void verify_checksums_one_by_one(ChecksumJob* jobs, size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    uint8_t sum[4];
+    bitcoin_checksum(jobs[i].payload, jobs[i].len, sum);
+    jobs[i].ok = std::memcmp(sum, jobs[i].expected, 4) == 0;
+  }
+}
 
-    ::close(socket_fd);
-    return 0;
+#if defined(__x86_64__)
+// sha256_transform_x8: one block for each of 8 independent messages.
+// state[word][lane] holds lane's state, so each word is one AVX2 register
+// and every instruction works on all 8 messages at once.
+__attribute__((target("avx2")))
+static inline __m256i rotr32x8(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+static void sha256_transform_x8(uint32_t state[8][8], const uint8_t* const block[8]) {
+  __m256i w[64];
+  for (int i = 0; i < 16; ++i) {
+    w[i] = _mm256_setr_epi32(
+        static_cast<int>(read_be32(block[0] + 4 * i)), static_cast<int>(read_be32(block[1] + 4 * i)),
+        static_cast<int>(read_be32(block[2] + 4 * i)), static_cast<int>(read_be32(block[3] + 4 * i)),
+        static_cast<int>(read_be32(block[4] + 4 * i)), static_cast<int>(read_be32(block[5] + 4 * i)),
+        static_cast<int>(read_be32(block[6] + 4 * i)), static_cast<int>(read_be32(block[7] + 4 * i)));
+  }
+  for (int i = 16; i < 64; ++i) {
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr32x8(w[i - 15], 7), rotr32x8(w[i - 15], 18)),
+                                  _mm256_srli_epi32(w[i - 15], 3));
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr32x8(w[i - 2], 17), rotr32x8(w[i - 2], 19)),
+                                  _mm256_srli_epi32(w[i - 2], 10));
+    w[i] = _mm256_add_epi32(_mm256_add_epi32(w[i - 16], s0), _mm256_add_epi32(w[i - 7], s1));
+  }
+  __m256i s[8];
+  for (int j = 0; j < 8; ++j) s[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(state[j]));
+  __m256i a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+  for (int i = 0; i < 64; ++i) {
+    __m256i sigma1 = _mm256_xor_si256(_mm256_xor_si256(rotr32x8(e, 6), rotr32x8(e, 11)), rotr32x8(e, 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, sigma1), ch);
+    t1 = _mm256_add_epi32(t1, _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(kSha256K[i])), w[i]));
+    __m256i sigma0 = _mm256_xor_si256(_mm256_xor_si256(rotr32x8(a, 2), rotr32x8(a, 13)), rotr32x8(a, 22));
+    __m256i maj = _mm256_xor_si256(_mm256_and_si256(a, b),
+                                   _mm256_and_si256(c, _mm256_xor_si256(a, b)));
+    __m256i t2 = _mm256_add_epi32(sigma0, maj);
+    h = g;
+    g = f;
+    f = e;
+    e = _mm256_add_epi32(d, t1);
+    d = c;
+    c = b;
+    b = a;
+    a = _mm256_add_epi32(t1, t2);
+  }
+  __m256i out[8] = {a, b, c, d, e, f, g, h};
+  for (int j = 0; j < 8; ++j) {
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(state[j]), _mm256_add_epi32(s[j], out[j]));
+  }
+}
+
+// Sha256Lane: where one lane of the multi-buffer hash is in its job.
+// A job is two hashes: the payload, then the 32-byte first digest.
+struct Sha256Lane {
+  ChecksumJob* job = nullptr;  // nullptr: idle
+  const uint8_t* data = nullptr;
+  size_t full_blocks = 0;      // blocks still to read straight from data
+  uint8_t tail[128];           // last partial block + padding
+  size_t tail_blocks = 0;
+  size_t tail_done = 0;
+  bool second = false;         // hashing the first digest
+};
+
+// start_hash: point the lane at a message and reset its state column
+static void start_hash(Sha256Lane* lane, uint32_t state[8][8], int index, const uint8_t* data,
+                       size_t len) {
+  lane->data = data;
+  lane->full_blocks = len / 64;
+  lane->tail_blocks = sha256_pad(data + lane->full_blocks * 64, len, lane->tail);
+  lane->tail_done = 0;
+  for (int j = 0; j < 8; ++j) state[j][index] = kSha256Init[j];
+}
+
+// next_block: the lane's next 64 bytes, from the payload or the padded tail
+static const uint8_t* next_block(Sha256Lane* lane) {
+  if (lane->full_blocks > 0) {
+    const uint8_t* block = lane->data;
+    lane->data += 64;
+    --lane->full_blocks;
+    return block;
+  }
+  return lane->tail + 64 * lane->tail_done++;
+}
+
+// finish_hash: the lane's digest; either start the second hash or check
+// the checksum. Returns true when the whole job is done.
+static bool finish_hash(Sha256Lane* lane, uint32_t state[8][8], int index) {
+  uint8_t digest[32];
+  for (int j = 0; j < 8; ++j) write_be32(digest + 4 * j, state[j][index]);
+  if (!lane->second) {
+    lane->second = true;
+    start_hash(lane, state, index, digest, sizeof(digest)); // the digest fits in tail
+    lane->data = lane->tail;
+    return false;
+  }
+  lane->job->ok = std::memcmp(digest, lane->job->expected, 4) == 0;
+  return true;
+}
+
+// verify_checksums_x8: keep 8 jobs in flight, refilling a lane as soon as
+// its job is done, so short and long payloads mix freely. Once there is
+// nothing left to refill from and only a couple of lanes still run, they
+// finish one at a time, which is faster than hashing 6 idle lanes.
+__attribute__((target("avx2")))
+static void verify_checksums_x8(ChecksumJob* jobs, size_t count) {
+  static const uint8_t kIdleBlock[64] = {0};
+  Sha256Lane lanes[8];
+  alignas(32) uint32_t state[8][8];
+  size_t next_job = 0;
+  int busy = 0;
+  auto refill = [&](int i) {
+    lanes[i].job = nullptr;
+    if (next_job == count) return;
+    lanes[i].job = &jobs[next_job++];
+    lanes[i].second = false;
+    start_hash(&lanes[i], state, i, lanes[i].job->payload, lanes[i].job->len);
+    ++busy;
+  };
+  for (int i = 0; i < 8; ++i) refill(i);
+
+  while (busy > 2 || (busy > 0 && next_job < count)) {
+    const uint8_t* blocks[8];
+    for (int i = 0; i < 8; ++i) blocks[i] = lanes[i].job ? next_block(&lanes[i]) : kIdleBlock;
+    sha256_transform_x8(state, blocks);
+    for (int i = 0; i < 8; ++i) {
+      Sha256Lane& lane = lanes[i];
+      if (!lane.job || lane.full_blocks > 0 || lane.tail_done < lane.tail_blocks) continue;
+      if (finish_hash(&lane, state, i)) {
+        --busy;
+        refill(i);
+      }
+    }
+  }
+
+  // The stragglers: pull each lane's state out and finish it on its own
+  for (int i = 0; i < 8; ++i) {
+    Sha256Lane& lane = lanes[i];
+    if (!lane.job) continue;
+    for (;;) {
+      uint32_t one[8];
+      for (int j = 0; j < 8; ++j) one[j] = state[j][i];
+      sha256_transform(one, lane.data, lane.full_blocks);
+      sha256_transform(one, lane.tail + 64 * lane.tail_done, lane.tail_blocks - lane.tail_done);
+      lane.full_blocks = 0;
+      lane.tail_done = lane.tail_blocks;
+      for (int j = 0; j < 8; ++j) state[j][i] = one[j];
+      if (finish_hash(&lane, state, i)) break;
+    }
+  }
+}
+#endif
+
+// VerifyChecksumsFn: set jobs[i].ok for a batch of received payloads
+using VerifyChecksumsFn = void (*)(ChecksumJob* jobs, size_t count);
+
+// pick_checksum_verifier: with SHA-NI one message at a time is already
+// the fastest; without it, AVX2 hashes 8 messages per pass.
+static VerifyChecksumsFn pick_checksum_verifier() {
+#if defined(__x86_64__)
+  if (!cpu_has_sha() && __builtin_cpu_supports("avx2")) return verify_checksums_x8;
+#endif
+  return verify_checksums_one_by_one;
+}
+
+static const VerifyChecksumsFn verify_checksums = pick_checksum_verifier();
+
+// -------------- bitcoin framing --------------
+
+// A Bitcoin P2P message on the wire:
+//
+//   offset  size  field
+//   0       4     magic     network id, 0xD9B4BEF9 (mainnet), little-endian
+//   4       12    command   ASCII, NUL-padded ("version", "tx", ...)
+//   16      4     length    payload size, little-endian
+//   20      4     checksum  first 4 bytes of SHA256(SHA256(payload))
+//   24      ...   payload
+//
+// The length tells us exactly how many bytes to read, so payload bytes are
+// never scanned for a delimiter.
+static constexpr size_t kBitcoinHeaderSize = 24;
+static constexpr size_t kBitcoinCommandSize = 12;
+static constexpr uint32_t kBitcoinMagic = 0xD9B4BEF9;
+static constexpr uint32_t kBitcoinMaxPayload = 32 * 1024 * 1024; // Bitcoin Core's MAX_SIZE
+
+static inline uint32_t read_le32(const uint8_t* p) {
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void write_le32(uint8_t* p, uint32_t v) {
+  p[0] = uint8_t(v);
+  p[1] = uint8_t(v >> 8);
+  p[2] = uint8_t(v >> 16);
+  p[3] = uint8_t(v >> 24);
+}
+
+struct BitcoinHeader {
+  uint32_t magic;
+  std::string_view command;  // without the NUL padding; points into the buffer parsed
+  uint32_t length;
+  uint8_t checksum[4];
+};
+
+// parse_bitcoin_header: decode the 24 bytes at p
+static BitcoinHeader parse_bitcoin_header(const char* p) {
+  const uint8_t* bytes = reinterpret_cast<const uint8_t*>(p);
+  BitcoinHeader header;
+  header.magic = read_le32(bytes);
+  const char* command = p + 4;
+  header.command = std::string_view(command, strnlen(command, kBitcoinCommandSize));
+  header.length = read_le32(bytes + 16);
+  std::memcpy(header.checksum, bytes + 20, 4);
+  return header;
+}
+
+// append_bitcoin_message: header + payload, ready to send, added to *wire
+static void append_bitcoin_message(std::string* wire, std::string_view command,
+                                   std::string_view payload) {
+  size_t start = wire->size();
+  wire->resize(start + kBitcoinHeaderSize + payload.size(), '\0');
+  uint8_t* bytes = reinterpret_cast<uint8_t*>(wire->data() + start);
+  write_le32(bytes, kBitcoinMagic);
+  std::memcpy(bytes + 4, command.data(), std::min(command.size(), kBitcoinCommandSize));
+  write_le32(bytes + 16, static_cast<uint32_t>(payload.size()));
+  bitcoin_checksum(reinterpret_cast<const uint8_t*>(payload.data()), payload.size(), bytes + 20);
+  std::memcpy(bytes + kBitcoinHeaderSize, payload.data(), payload.size());
+}
+
+// append_printable: append the payload as text, or as hex if it isn't text
+static void append_printable(std::string* out, std::string_view payload) {
+  bool text = true;
+  for (char c : payload) {
+    if (static_cast<unsigned char>(c) < 0x20 || static_cast<unsigned char>(c) > 0x7e) text = false;
+  }
+  if (text) {
+    out->append(payload);
+    return;
+  }
+  static const char kHex[] = "0123456789abcdef";
+  out->append("0x");
+  size_t shown = std::min<size_t>(payload.size(), 64);
+  for (size_t i = 0; i < shown; ++i) {
+    out->push_back(kHex[static_cast<unsigned char>(payload[i]) >> 4]);
+    out->push_back(kHex[static_cast<unsigned char>(payload[i]) & 0xf]);
+  }
+  if (shown < payload.size()) out->append("...");
+}
+
+// -------------- framing --------------
+// Turning a receive buffer into messages. None of this knows about
+// sockets or peers, so the same code runs on synthetic buffers in
+// --bench-framing.
+
+// OwnedMessage: a Message's bytes copied out of the buffer (see retain())
+struct OwnedMessage {
+  std::string command;
+  std::string payload;
+};
+
+// Message: one framed message, as views into a receive buffer.
+// The views are only valid while the handler runs: the buffer is consumed
+// (and may be compacted) right after. A handler that needs the bytes later
+// calls retain() for its own copy.
+struct Message {
+  std::string_view command;  // bitcoin framing; empty for lines
+  std::string_view payload;  // the line without its '\n', or the payload
+  // retain: copy the bytes out, to keep them past the handler
+  OwnedMessage retain() const { return {std::string(command), std::string(payload)}; }
+};
+
+// FrameState: how far framing of one stream has got
+struct FrameState {
+  size_t scanned = 0;  // lines: unread bytes already searched for '\n'
+  size_t wanted = 0;   // bitcoin: bytes still missing for the next message
+  bool short_lines = false; // lines: the last lines were short (see frame_lines)
+};
+
+// FrameScratch: what one thread's framing calls share. The vectors are
+// reused, so framing allocates nothing once they have grown; the scanner
+// and verifier are the ones picked for this CPU unless a benchmark swaps
+// them.
+struct FrameScratch {
+  std::vector<size_t> newlines;
+  std::vector<ChecksumJob> checksum_jobs;
+  ScanFn scan = scan_delimiters;
+  bool adaptive = true;  // lines: memchr() unless lines are short (false: always scan)
+  VerifyChecksumsFn verify = verify_checksums;
+};
+
+// kShortLineBytes: lines shorter than this on average are found faster by
+// scanning a whole read for every '\n' at once; longer ones by one
+// memchr() per line, which skips long stretches faster than our scanners
+// (--bench-framing: at 16 B messages the AVX2 scan is ~10-30% ahead, from
+// 128 B on memchr() is ~25% ahead and more)
+static constexpr size_t kShortLineBytes = 64;
+
+// FrameResult: how a framing call ended
+enum class FrameResult {
+  kDone,        // every complete message was handed on and consumed
+  kStopped,     // the handler returned false; don't touch the buffer again
+  kBadHeader,   // bitcoin: wrong magic or an oversized length
+  kBadChecksum, // bitcoin: a payload that doesn't match its header
+};
+
+// frame_lines: pull out complete lines (messages end with '\n') and pass
+// each to handler(const Message&), which returns false to stop.
+// Short lines are found with one SIMD pass over all new bytes that yields
+// every newline; long ones with one memchr() per line. Which of the two
+// follows the stream: the average length of the lines framed last time
+// picks the way for the next call. Either way the lines are handed out as
+// spans into the buffer and consumed together with one cursor move.
+template <typename Handler>
+static FrameResult frame_lines(RecvBuffer& in, FrameState* state, FrameScratch* scratch,
+                               Handler&& handler) {
+  if (in.size() <= state->scanned) return FrameResult::kDone;
+  const char* start = in.data();
+  size_t line_start = 0;
+  size_t lines = 0;
+  if (scratch->adaptive && !state->short_lines) {
+    size_t scanned = state->scanned;
+    while (const void* found = std::memchr(start + scanned, '\n', in.size() - scanned)) {
+      size_t line_end = static_cast<size_t>(static_cast<const char*>(found) - start);
+      Message message;
+      message.payload = std::string_view(start + line_start, line_end - line_start);
+      if (!handler(message)) return FrameResult::kStopped;
+      ++lines;
+      line_start = scanned = line_end + 1;
+    }
+  } else {
+    std::vector<size_t>& newlines = scratch->newlines;
+    newlines.clear();
+    scratch->scan(start + state->scanned, in.size() - state->scanned, '\n', &newlines);
+    for (size_t offset : newlines) {
+      size_t line_end = state->scanned + offset;
+      Message message;
+      message.payload = std::string_view(start + line_start, line_end - line_start);
+      if (!handler(message)) return FrameResult::kStopped;
+      line_start = line_end + 1;
+    }
+    lines = newlines.size();
+  }
+  if (lines > 0) state->short_lines = line_start < lines * kShortLineBytes;
+  in.consume(line_start);
+  state->scanned = in.size(); // the partial line left over has no '\n'
+  return FrameResult::kDone;
+}
+
+// frame_bitcoin_messages: pull out every complete header + payload.
+// The header's length field says where the message ends; the payload
+// itself is never scanned. Checksums of everything that arrived are
+// verified in one batch before any message is handed on; on a bad one
+// the good messages before it are still delivered.
+template <typename Handler>
+static FrameResult frame_bitcoin_messages(RecvBuffer& in, FrameState* state,
+                                          FrameScratch* scratch, Handler&& handler) {
+  std::vector<ChecksumJob>& jobs = scratch->checksum_jobs;
+  jobs.clear();
+  state->wanted = 0;
+  bool bad_header = false;
+  size_t offset = 0;
+  while (in.size() - offset >= kBitcoinHeaderSize) {
+    const char* start = in.data() + offset;
+    BitcoinHeader header = parse_bitcoin_header(start);
+    if (header.magic != kBitcoinMagic || header.length > kBitcoinMaxPayload) {
+      bad_header = true;
+      break;
+    }
+    size_t total = kBitcoinHeaderSize + header.length;
+    if (in.size() - offset < total) {
+      state->wanted = total - (in.size() - offset);
+      break;
+    }
+    ChecksumJob job;
+    job.payload = reinterpret_cast<const uint8_t*>(start + kBitcoinHeaderSize);
+    job.len = header.length;
+    job.expected = reinterpret_cast<const uint8_t*>(start + 20);
+    jobs.push_back(job);
+    offset += total;
+  }
+  scratch->verify(jobs.data(), jobs.size());
+
+  for (const ChecksumJob& job : jobs) {
+    if (!job.ok) return FrameResult::kBadChecksum;
+    const char* start = reinterpret_cast<const char*>(job.payload) - kBitcoinHeaderSize;
+    Message message;
+    message.command = parse_bitcoin_header(start).command;
+    message.payload = std::string_view(start + kBitcoinHeaderSize, job.len);
+    if (!handler(message)) return FrameResult::kStopped;
+  }
+  if (bad_header) return FrameResult::kBadHeader;
+  in.consume(offset);
+  return FrameResult::kDone;
+}
+
+// -------------- output --------------
+
+// OutputSink: where received messages end up. A Node formats a whole
+// batch of messages into one buffer and hands it over with one write();
+// count() reports every batch's size. Sinks are shared by all Nodes, so
+// each must be safe to call from several threads.
+class OutputSink {
+ public:
+  virtual ~OutputSink() = default;
+  // wants_text: false if the sink only counts, so Nodes skip formatting
+  virtual bool wants_text() const { return true; }
+  virtual void write(const char* data, size_t len) = 0;
+  virtual void count(size_t messages, size_t bytes) { (void)messages; (void)bytes; }
+  // finish: everything has been written; say goodbye if there's a summary
+  virtual void finish() {}
+};
+
+// FdSink: the terminal (stdout) or a file. One batch, one write() call
+// (unless the fd takes it in pieces).
+class FdSink : public OutputSink {
+ public:
+  FdSink(int fd, bool owned) : fd_(fd), owned_(owned) {}
+  ~FdSink() override {
+    if (owned_) ::close(fd_);
+  }
+
+  void write(const char* data, size_t len) override {
+    while (len > 0) {
+      ssize_t n = ::write(fd_, data, len);
+      ++syscall_count;
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        return; // nowhere to report a broken stdout
+      }
+      data += n;
+      len -= static_cast<size_t>(n);
+    }
+  }
+
+ private:
+  int fd_;
+  bool owned_;
+};
+
+// NullSink: format everything, keep nothing (like > /dev/null, minus the syscalls)
+class NullSink : public OutputSink {
+ public:
+  void write(const char*, size_t) override {}
+};
+
+// CountingSink: don't format at all; print the totals at the end
+class CountingSink : public OutputSink {
+ public:
+  bool wants_text() const override { return false; }
+  void write(const char*, size_t) override {}
+  void count(size_t messages, size_t bytes) override {
+    messages_.fetch_add(messages, std::memory_order_relaxed);
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+  }
+  void finish() override {
+    std::cout << ("received " + std::to_string(messages_.load()) + " messages, " +
+                  std::to_string(bytes_.load()) + " payload bytes\n") << std::flush;
+  }
+
+ private:
+  std::atomic<uint64_t> messages_{0};
+  std::atomic<uint64_t> bytes_{0};
+};
+
+// open_output: the sink named by --output (stdout, null, count, file:PATH)
+static std::shared_ptr<OutputSink> open_output(const std::string& spec) {
+  if (spec == "stdout") return std::make_shared<FdSink>(1, false);
+  if (spec == "null") return std::make_shared<NullSink>();
+  if (spec == "count") return std::make_shared<CountingSink>();
+  if (spec.rfind("file:", 0) == 0) {
+    std::string path = spec.substr(5);
+    // O_APPEND: batches from several threads never overwrite each other
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      std::cerr << "can't open " << path << ": " << std::strerror(errno) << "\n";
+      return nullptr;
+    }
+    return std::make_shared<FdSink>(fd, true);
+  }
+  std::cerr << "unknown --output: " << spec << "\n";
+  return nullptr;
+}
+
+// -------------- benchmarks --------------
+
+// UsageSample: wall clock, CPU time and syscall_count of the calling
+// thread at one moment; two of them bracket a benchmark run
+struct UsageSample {
+  int64_t wall_us = 0;
+  int64_t cpu_us = 0; // user + system
+  uint64_t syscalls = 0;
+
+  static UsageSample now() {
+    UsageSample sample;
+    sample.wall_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now().time_since_epoch())
+                         .count();
+    rusage usage;
+    if (::getrusage(RUSAGE_THREAD, &usage) == 0) {
+      sample.cpu_us = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000LL +
+                      usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    }
+    sample.syscalls = syscall_count;
+    return sample;
+  }
+};
+
+// bench_report: one line with the rates between two samples
+static std::string bench_report(const char* label, uint64_t messages, uint64_t bytes,
+                                const UsageSample& start, const UsageSample& end) {
+  double seconds = std::max<int64_t>(end.wall_us - start.wall_us, 1) / 1e6;
+  double cpu = (end.cpu_us - start.cpu_us) / 1e6;
+  double per_message = messages ? double(end.syscalls - start.syscalls) / double(messages) : 0;
+  char line[256];
+  std::snprintf(line, sizeof(line),
+                "%s: %llu messages, %llu payload bytes in %.3f s: %.0f msg/s, %.1f MB/s, "
+                "cpu %.3f s (%.0f%%), %.4f syscalls/msg\n",
+                label, static_cast<unsigned long long>(messages),
+                static_cast<unsigned long long>(bytes), seconds, messages / seconds,
+                bytes / seconds / 1e6, cpu, 100 * cpu / seconds, per_message);
+  return line;
+}
+
+// LatencyHistogram: nanosecond samples in log-linear buckets, HDR style.
+// Values below 2^(kSubBits+1) get a bucket each; above that every power
+// of two is split into 2^kSubBits buckets, so a value is known to within
+// 1/128 (under 1%) whatever its size, in a fixed 60 KB table.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(bucket_of(~uint64_t{0}) + 1) {}
+
+  void record(uint64_t ns) {
+    ++counts_[bucket_of(ns)];
+    ++total_;
+    sum_ += ns;
+    max_ = std::max(max_, ns);
+  }
+
+  uint64_t count() const { return total_; }
+  uint64_t max() const { return max_; }
+  uint64_t sum() const { return sum_; }
+
+  // count_at_or_below: samples no larger than ns (to bucket precision)
+  uint64_t count_at_or_below(uint64_t ns) const {
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size() && bucket_top(i) <= ns; ++i) seen += counts_[i];
+    return seen;
+  }
+
+  // merge: add another histogram's samples to this one
+  void merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < counts_.size(); ++i) counts_[i] += other.counts_[i];
+    total_ += other.total_;
+    sum_ += other.sum_;
+    max_ = std::max(max_, other.max_);
+  }
+
+  // percentile: smallest value with at least p percent of the samples at
+  // or below it (the top of its bucket, capped at the true max)
+  uint64_t percentile(double p) const {
+    if (total_ == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(std::ceil(p / 100 * total_));
+    if (rank == 0) rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts_.size(); ++i) {
+      seen += counts_[i];
+      if (seen >= rank) return std::min(bucket_top(i), max_);
+    }
+    return max_;
+  }
+
+  void reset() {
+    std::fill(counts_.begin(), counts_.end(), 0);
+    total_ = 0;
+    sum_ = 0;
+    max_ = 0;
+  }
+
+ private:
+  static constexpr int kSubBits = 7;
+  static constexpr uint64_t kSub = uint64_t{1} << kSubBits;
+
+  static size_t bucket_of(uint64_t ns) {
+    if (ns < 2 * kSub) return static_cast<size_t>(ns);
+    int shift = 63 - __builtin_clzll(ns) - kSubBits; // >= 1
+    return static_cast<size_t>(2 * kSub + (shift - 1) * kSub + ((ns >> shift) - kSub));
+  }
+
+  // bucket_top: the largest value that lands in bucket i
+  static uint64_t bucket_top(size_t i) {
+    if (i < 2 * kSub) return i;
+    int shift = static_cast<int>((i - 2 * kSub) / kSub) + 1;
+    uint64_t top = kSub + (i - 2 * kSub) % kSub;
+    return ((top + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts_;
+  uint64_t total_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t max_ = 0;
+};
+
+// latency_report: one line of percentiles, in microseconds, of samples
+// that are `what` ("probes", "connections")
+static std::string latency_report(const char* label, const LatencyHistogram& histogram,
+                                  const char* what = "probes") {
+  char line[256];
+  std::snprintf(line, sizeof(line),
+                "%s: %llu %s, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+                label, static_cast<unsigned long long>(histogram.count()), what,
+                histogram.percentile(50) / 1e3, histogram.percentile(99) / 1e3,
+                histogram.percentile(99.9) / 1e3, histogram.max() / 1e3);
+  return line;
+}
+
+// Framing benchmark (--bench-framing): framing strategies timed on
+// synthetic streams, without sockets. Each stream is fed in fixed-size
+// pieces, the way recv() hands them over, so the split points fall
+// everywhere: mid-line, mid-header, mid-payload.
+
+// FramingCount: what a strategy found; all of them must agree
+struct FramingCount {
+  uint64_t messages = 0;
+  uint64_t bytes = 0; // payload bytes
+  bool operator==(const FramingCount&) const = default;
+};
+
+// frame_substr_erase: the original line framing: a std::string buffer,
+// find() the newline, copy the line out with substr(), erase() it
+static FramingCount frame_substr_erase(const std::string& stream, size_t read_size) {
+  FramingCount count;
+  std::string incoming_buffer;
+  for (size_t at = 0; at < stream.size(); at += read_size) {
+    incoming_buffer.append(stream, at, read_size);
+    size_t pos;
+    while ((pos = incoming_buffer.find('\n')) != std::string::npos) {
+      std::string one_line = incoming_buffer.substr(0, pos);
+      incoming_buffer.erase(0, pos + 1);
+      ++count.messages;
+      count.bytes += one_line.size();
+    }
+  }
+  return count;
+}
+
+// frame_memchr: the cursor buffer with one memchr() per line
+static FramingCount frame_memchr(const std::string& stream, size_t read_size) {
+  FramingCount count;
+  RecvBuffer in;
+  size_t scanned = 0;
+  for (size_t at = 0; at < stream.size(); at += read_size) {
+    in.append(stream.data() + at, std::min(read_size, stream.size() - at));
+    const char* start = in.data();
+    size_t line_start = 0;
+    while (const void* found = std::memchr(start + scanned, '\n', in.size() - scanned)) {
+      size_t line_end = static_cast<size_t>(static_cast<const char*>(found) - start);
+      ++count.messages;
+      count.bytes += line_end - line_start;
+      line_start = scanned = line_end + 1;
+    }
+    in.consume(line_start);
+    scanned = in.size();
+  }
+  return count;
+}
+
+// frame_with: frame_lines / frame_bitcoin_messages as peers use them,
+// with the given scanner and checksum verifier
+static FramingCount frame_with(const std::string& stream, size_t read_size, bool bitcoin,
+                               ScanFn scan, bool adaptive, VerifyChecksumsFn verify) {
+  FramingCount count;
+  FrameScratch scratch;
+  scratch.scan = scan;
+  scratch.adaptive = adaptive;
+  scratch.verify = verify;
+  RecvBuffer in;
+  FrameState state;
+  auto handle = [&count](const Message& message) {
+    ++count.messages;
+    count.bytes += message.payload.size();
+    return true;
+  };
+  for (size_t at = 0; at < stream.size(); at += read_size) {
+    in.append(stream.data() + at, std::min(read_size, stream.size() - at));
+    if (bitcoin) frame_bitcoin_messages(in, &state, &scratch, handle);
+    else frame_lines(in, &state, &scratch, handle);
+  }
+  return count;
+}
+
+// FramingStrategy: one way to frame a stream, for the benchmark table
+struct FramingStrategy {
+  const char* name;
+  bool bitcoin;
+  bool in_use; // what peers use on this CPU
+  std::function<FramingCount(const std::string& stream, size_t read_size)> run;
+};
+
+static std::vector<FramingStrategy> framing_strategies() {
+  std::vector<FramingStrategy> strategies;
+  auto lines_with = [](ScanFn scan, bool adaptive) {
+    return [scan, adaptive](const std::string& stream, size_t read_size) {
+      return frame_with(stream, read_size, false, scan, adaptive, verify_checksums);
+    };
+  };
+  auto bitcoin_with = [](VerifyChecksumsFn verify) {
+    return [verify](const std::string& stream, size_t read_size) {
+      return frame_with(stream, read_size, true, scan_delimiters, true, verify);
+    };
+  };
+  strategies.push_back({"substr+erase", false, false, frame_substr_erase});
+  strategies.push_back({"memchr", false, false, frame_memchr});
+  strategies.push_back({"scan scalar", false, false, lines_with(scan_delimiters_scalar, false)});
+#if defined(__x86_64__)
+  strategies.push_back({"scan sse2", false, false, lines_with(scan_delimiters_sse2, false)});
+  if (__builtin_cpu_supports("avx2")) {
+    strategies.push_back({"scan avx2", false, false, lines_with(scan_delimiters_avx2, false)});
+  }
+#endif
+  strategies.push_back({"adaptive", false, true, lines_with(scan_delimiters, true)});
+  strategies.push_back({"bitcoin 1-by-1", true, verify_checksums == verify_checksums_one_by_one,
+                        bitcoin_with(verify_checksums_one_by_one)});
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("avx2")) {
+    strategies.push_back({"bitcoin x8", true, verify_checksums == verify_checksums_x8,
+                          bitcoin_with(verify_checksums_x8)});
+  }
+#endif
+  return strategies;
+}
+
+// make_stream: about `bytes` of messages whose payloads average
+// mean_size (anywhere from half to one and a half times it)
+static std::string make_stream(bool bitcoin, size_t mean_size, size_t bytes,
+                               FramingCount* expected) {
+  std::mt19937 rng(1);
+  std::uniform_int_distribution<size_t> size(mean_size / 2, mean_size + mean_size / 2);
+  std::string stream;
+  *expected = FramingCount();
+  while (stream.size() < bytes) {
+    std::string payload(size(rng), 'x');
+    if (bitcoin) {
+      append_bitcoin_message(&stream, "bench", payload);
+    } else {
+      stream.append(payload).push_back('\n');
+    }
+    ++expected->messages;
+    expected->bytes += payload.size();
+  }
+  return stream;
+}
+
+// run_framing_benchmark: every strategy on every message size and read
+// size; each runs until it has taken kMinRunMs, and must find exactly
+// the messages that were generated
+static int run_framing_benchmark() {
+  constexpr size_t kStreamBytes = 2 << 20;
+  constexpr int64_t kMinRunMs = 100;
+  const size_t message_sizes[] = {16, 128, 1024, 16384};
+  const size_t read_sizes[] = {64, 1448, 65536}; // tiny, one MSS, a full recv
+  std::vector<FramingStrategy> strategies = framing_strategies();
+
+  std::cout << "strategy         payload     read       MB/s     ns/msg\n";
+  for (bool bitcoin : {false, true}) {
+    for (size_t message_size : message_sizes) {
+      FramingCount expected;
+      std::string stream = make_stream(bitcoin, message_size, kStreamBytes, &expected);
+      for (size_t read_size : read_sizes) {
+        for (const FramingStrategy& strategy : strategies) {
+          if (strategy.bitcoin != bitcoin) continue;
+          auto start = std::chrono::steady_clock::now();
+          auto elapsed = std::chrono::steady_clock::duration::zero();
+          uint64_t runs = 0;
+          do {
+            FramingCount found = strategy.run(stream, read_size);
+            if (!(found == expected)) {
+              std::cerr << strategy.name << " found " << found.messages << " messages, expected "
+                        << expected.messages << "\n";
+              return 1;
+            }
+            ++runs;
+            elapsed = std::chrono::steady_clock::now() - start;
+          } while (elapsed < std::chrono::milliseconds(kMinRunMs));
+          double seconds = std::chrono::duration<double>(elapsed).count();
+          char line[128];
+          std::snprintf(line, sizeof(line), "%-15s%c %7zu %8zu %10.1f %10.1f\n", strategy.name,
+                        strategy.in_use ? '*' : ' ', message_size, read_size,
+                        runs * stream.size() / seconds / 1e6,
+                        seconds * 1e9 / (runs * expected.messages));
+          std::cout << line;
+        }
+      }
+    }
+  }
+  std::cout << "* what peers use on this CPU\n";
+  return 0;
+}
+
+// -------------- metrics --------------
+
+// MetricsSnapshot: one Node's counters at one moment. Nodes copy their
+// live state into one of these now and then (off the message path); the
+// metrics page is rendered from the copies and never touches live state.
+struct MetricsSnapshot {
+  uint64_t peers = 0;                // connected now
+  uint64_t connections_opened = 0;
+  uint64_t connections_closed = 0;
+  uint64_t dropped_send_hwm = 0;     // peers dropped at --send-hwm
+  uint64_t dropped_slow = 0;         // ... by --slow-peer-ms
+  uint64_t messages_in = 0;
+  uint64_t messages_out = 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  uint64_t recv_calls = 0;
+  uint64_t send_calls = 0;
+  uint64_t partial_sends = 0;
+  uint64_t recv_buffer_bytes = 0;    // receive buffer memory held
+  uint64_t send_queue_bytes = 0;     // bytes queued, not yet sent
+  LatencyHistogram tcp_rtt;          // every TCP_INFO RTT sample
+  LatencyHistogram ping_rtt;         // --ping round trips
+};
+
+// MetricsBoard: the latest snapshot of every Node, shared by all threads.
+// The mutex is taken once per snapshot and once per scrape, never per
+// message.
+class MetricsBoard {
+ public:
+  explicit MetricsBoard(size_t nodes) : snapshots_(nodes) {}
+
+  void publish(size_t node, MetricsSnapshot snapshot) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    snapshots_[node] = std::move(snapshot);
+  }
+
+  // total: every Node's snapshot added up
+  MetricsSnapshot total() const {
+    MetricsSnapshot sum;
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const MetricsSnapshot& one : snapshots_) {
+      sum.peers += one.peers;
+      sum.connections_opened += one.connections_opened;
+      sum.connections_closed += one.connections_closed;
+      sum.dropped_send_hwm += one.dropped_send_hwm;
+      sum.dropped_slow += one.dropped_slow;
+      sum.messages_in += one.messages_in;
+      sum.messages_out += one.messages_out;
+      sum.bytes_in += one.bytes_in;
+      sum.bytes_out += one.bytes_out;
+      sum.recv_calls += one.recv_calls;
+      sum.send_calls += one.send_calls;
+      sum.partial_sends += one.partial_sends;
+      sum.recv_buffer_bytes += one.recv_buffer_bytes;
+      sum.send_queue_bytes += one.send_queue_bytes;
+      sum.tcp_rtt.merge(one.tcp_rtt);
+      sum.ping_rtt.merge(one.ping_rtt);
+    }
+    return sum;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<MetricsSnapshot> snapshots_;
+};
+
+// resident_bytes: this process's resident memory, from /proc/self/statm
+static uint64_t resident_bytes() {
+  int fd = ::open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  char text[128];
+  ssize_t n = ::read(fd, text, sizeof(text) - 1);
+  ::close(fd);
+  if (n <= 0) return 0;
+  text[n] = '\0';
+  unsigned long long size = 0, resident = 0;
+  if (std::sscanf(text, "%llu %llu", &size, &resident) != 2) return 0;
+  return resident * static_cast<uint64_t>(::sysconf(_SC_PAGESIZE));
+}
+
+// append_metric: one metric family with a single sample per label set
+static void append_metric(std::string* out, const char* name, const char* type, const char* help,
+                          std::initializer_list<std::pair<const char*, uint64_t>> samples) {
+  out->append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out->append("# TYPE ").append(name).append(" ").append(type).append("\n");
+  for (const auto& [labels, value] : samples) {
+    out->append(name).append(labels).append(" ").append(std::to_string(value)).append("\n");
+  }
+}
+
+// append_histogram: a LatencyHistogram as a Prometheus histogram in seconds
+static void append_histogram(std::string* out, const char* name, const char* help,
+                             const LatencyHistogram& histogram) {
+  static const double kBounds[] = {50e-6, 100e-6, 250e-6, 500e-6, 1e-3, 2.5e-3, 5e-3, 10e-3,
+                                   25e-3, 50e-3,  100e-3, 250e-3, 500e-3, 1.0, 2.5,   5.0};
+  out->append("# HELP ").append(name).append(" ").append(help).append("\n");
+  out->append("# TYPE ").append(name).append(" histogram\n");
+  char line[160];
+  for (double bound : kBounds) {
+    uint64_t count = histogram.count_at_or_below(static_cast<uint64_t>(bound * 1e9));
+    std::snprintf(line, sizeof(line), "%s_bucket{le=\"%g\"} %llu\n", name, bound,
+                  static_cast<unsigned long long>(count));
+    out->append(line);
+  }
+  std::snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                name, static_cast<unsigned long long>(histogram.count()), name,
+                histogram.sum() / 1e9, name, static_cast<unsigned long long>(histogram.count()));
+  out->append(line);
+}
+
+// render_metrics: the Prometheus text exposition of a snapshot
+static std::string render_metrics(const MetricsSnapshot& m) {
+  std::string out;
+  append_metric(&out, "tcp_peer_connections", "gauge", "Peers connected now.", {{"", m.peers}});
+  append_metric(&out, "tcp_peer_connections_opened_total", "counter", "Peers connected.",
+                {{"", m.connections_opened}});
+  append_metric(&out, "tcp_peer_connections_closed_total", "counter", "Peers disconnected.",
+                {{"", m.connections_closed}});
+  append_metric(&out, "tcp_peer_dropped_peers_total", "counter",
+                "Peers disconnected for falling behind.",
+                {{"{reason=\"send_hwm\"}", m.dropped_send_hwm}, {"{reason=\"slow\"}", m.dropped_slow}});
+  append_metric(&out, "tcp_peer_messages_total", "counter", "Messages received and queued to send.",
+                {{"{direction=\"in\"}", m.messages_in}, {"{direction=\"out\"}", m.messages_out}});
+  append_metric(&out, "tcp_peer_bytes_total", "counter", "Bytes received and sent.",
+                {{"{direction=\"in\"}", m.bytes_in}, {"{direction=\"out\"}", m.bytes_out}});
+  append_metric(&out, "tcp_peer_socket_calls_total", "counter",
+                "recv and send system calls (io_uring operations with --engine=uring).",
+                {{"{call=\"recv\"}", m.recv_calls}, {"{call=\"send\"}", m.send_calls}});
+  append_metric(&out, "tcp_peer_partial_sends_total", "counter",
+                "Sends the socket took only part of.", {{"", m.partial_sends}});
+  append_metric(&out, "tcp_peer_buffer_bytes", "gauge", "Peer buffer memory.",
+                {{"{buffer=\"recv\"}", m.recv_buffer_bytes}, {"{buffer=\"send\"}", m.send_queue_bytes}});
+  append_metric(&out, "tcp_peer_resident_memory_bytes", "gauge", "Resident set size.",
+                {{"", resident_bytes()}});
+  append_histogram(&out, "tcp_peer_tcp_rtt_seconds", "Smoothed RTT of each TCP_INFO sample.",
+                   m.tcp_rtt);
+  if (m.ping_rtt.count() > 0) {
+    append_histogram(&out, "tcp_peer_ping_rtt_seconds", "Round trips measured by --ping.",
+                     m.ping_rtt);
+  }
+  return out;
+}
+
+// -------------- peers --------------
+
+// PeerStats: counters for one connection. Only the Node's own thread
+// touches them (dumps run there too), so they are plain integers: no
+// locks or atomics on the hot path. Sends are counted by the SendQueue
+// (or UringEngine) that makes them.
+struct PeerStats {
+  uint64_t bytes_in = 0;
+  uint64_t messages_in = 0;
+  uint64_t recv_calls = 0;      // recv()s, or io_uring recv completions
+  uint64_t messages_out = 0;    // queued for this peer
+  size_t recv_buffer_high = 0;  // most unframed bytes held at once
+  size_t send_queue_high = 0;   // most unsent bytes queued at once
+
+  // From the last TCP_INFO sample (--tcp-info-ms)
+  uint32_t rtt_us = 0;          // smoothed round-trip time
+  uint32_t cwnd = 0;            // congestion window, in segments
+  uint32_t mss = 0;
+  uint32_t retransmits = 0;     // segments retransmitted, ever
+  uint32_t unacked = 0;         // segments sent and not yet acked
+  uint32_t notsent = 0;         // bytes in the socket buffer not yet sent
+  uint32_t peer_window = 0;     // the peer's receive window
+  bool window_known = false;    // ... if this kernel reports it
+  uint64_t delivery_rate = 0;   // bytes/s, the kernel's estimate (0 = unknown)
+  int64_t slow_since_ms = 0;    // when it started falling behind (0 = it isn't)
+};
+
+class Node;
+
+// StatsRequest: one stats table being gathered from every Node's thread
+struct StatsRequest {
+  Node* collector = nullptr;     // prints the table
+  std::mutex mutex;
+  std::vector<std::string> rows; // by Node; guarded by mutex
+  size_t pending = 0;            // Nodes yet to answer; guarded by mutex
+};
+
+// Peer: one connected socket plus the bytes we have not framed yet
+struct Peer {
+  int fd = -1;
+  std::string name;            // "ip:port", used when printing messages
+  RecvBuffer incoming_buffer;   // holds partial bytes until a full line arrives
+  SendQueue outgoing;          // messages the socket hasn't taken yet
+  bool want_write = false;     // EPOLLOUT is on while outgoing isn't empty
+  bool flush_pending = false;  // in Node::dirty_, waiting for the batch flush
+  FrameState framing;          // where framing of incoming_buffer stands
+  int candidate = -1;          // outbound: index into the candidate list
+  PeerStats stats;
+};
+
+// Node: the reactor, an optional listener, and every connected peer.
+// Lines typed on stdin are sent to all peers; lines from any peer are printed.
+// Outbound peers come from a candidate list: the Node keeps a target number
+// of them connected, replacing any that fail (with backoff).
+// With --threads N there is one Node per thread; only the first reads stdin
+// and it forwards each line to the others through their mailbox.
+// Socket I/O goes through plain recv()/send() or, with --engine=uring,
+// through the UringEngine; everything else is the same for both.
+class Node {
+ public:
+  bool open(const Options& opt) {
+    if (!reactor_.open()) return false;
+    bitcoin_framing_ = (opt.framing == "bitcoin");
+    send_high_water_ = opt.send_high_water;
+    coalesce_ms_ = opt.coalesce_ms;
+    coalesce_bytes_ = opt.coalesce_bytes;
+    zerocopy_min_ = opt.zerocopy_min;
+    if (!opt.send_file.empty() && !open_send_file(opt.send_file)) return false;
+    recv_file_path_ = opt.recv_file;
+    bench_tx_ = opt.bench_tx;
+    bench_rx_ = opt.bench_rx;
+    bench_count_ = opt.bench_count;
+    bench_size_ = opt.bench_size;
+    if (bench_tx_) {
+      std::string payload(opt.bench_size, 'x');
+      append_message(&bench_message_, bitcoin_framing_ ? "bench " + payload : payload);
+    }
+    if (bench_rx_) {
+      message_handler_ = [this](Peer&, const Message& message) {
+        if (bench_rx_messages_ == 0) bench_start_ = UsageSample::now();
+        ++bench_rx_messages_;
+        bench_rx_bytes_ += message.payload.size();
+      };
+    }
+    ping_ = opt.ping;
+    echo_ = opt.echo;
+    ping_count_ = opt.ping_count;
+    report_ms_ = opt.report_ms;
+    quiet_ = opt.quiet;
+    stats_ms_ = opt.stats_ms;
+    tcp_info_ms_ = opt.tcp_info_ms;
+    slow_peer_ms_ = opt.slow_peer_ms;
+    if (tcp_info_ms_ > 0) reactor_.add_timer(tcp_info_ms_, [this] { sample_tcp_info(); });
+    if (ping_ || echo_) {
+      message_handler_ = [this](Peer& peer, const Message& message) {
+        on_latency_message(peer, message);
+      };
+    }
+    reactor_.set_before_wait([this] { before_wait(); });
+    if (opt.engine == "uring") {
+      auto uring = std::make_unique<UringEngine>();
+      // Every peer is a file descriptor, so the fd limit bounds the peers
+      rlimit files;
+      size_t max_peers = ::getrlimit(RLIMIT_NOFILE, &files) == 0 ? files.rlim_cur : 1024;
+      bool ok = uring->open(
+          [this](int fd, const char* data, size_t len) { on_peer_bytes(fd, data, len); },
+          [this](int fd, int res) { on_peer_closed(fd, res); }, max_peers);
+      if (ok) {
+        uring_ = std::move(uring);
+        UringEngine* engine = uring_.get();
+        if (!reactor_.add(engine->ring_fd(), EPOLLIN, [engine](uint32_t) { engine->reap(); })) {
+          return false;
+        }
+      } else {
+        std::cerr << "io_uring unavailable; falling back to epoll\n";
+      }
+    }
+    // The mailbox eventfd lets other threads hand us lines (or a stop)
+    mailbox_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mailbox_fd_ < 0) {
+      std::cerr << "eventfd() failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    return reactor_.add(mailbox_fd_, EPOLLIN, [this](uint32_t) { on_mailbox(); });
+  }
+
+  // watch_stdin: start sending the lines typed on stdin to our peers
+  bool watch_stdin() {
+    if (stdin_watched_ || file_mode() || bench_rx_ || churning_ || ping_ || echo_) return true;
+    stdin_watched_ = true;
+    if (bench_tx_) {
+      // Generated messages stand in for stdin
+      stdin_polled_ = true;
+      poll_stdin();
+      return true;
+    }
+    // Watch your keyboard (stdin, fd=0)
+    if (reactor_.add(0, EPOLLIN, [this](uint32_t) { on_stdin(); })) return true;
+    if (errno != EPERM) return false;
+    // stdin is a file (./tcp_peer ... < file): always readable, so just poll it
+    stdin_polled_ = true;
+    poll_stdin();
+    return true;
+  }
+
+  // forward_stdin_to: also send our stdin lines to these Nodes (other threads)
+  void forward_stdin_to(std::vector<Node*> siblings) { siblings_ = std::move(siblings); }
+
+  // post_line / post_stop / post_stats: thread-safe; the work runs on
+  // this Node's thread
+  void post_line(const SendQueue::Chunk& line, size_t messages = 1) {
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      mailbox_lines_.push_back({line, messages});
+    }
+    wake();
+  }
+  void post_stats(std::shared_ptr<StatsRequest> request, size_t index) {
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      mailbox_stats_.push_back({std::move(request), index});
+    }
+    wake();
+  }
+  void post_stop() {
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      mailbox_stop_ = true;
+    }
+    wake();
+  }
+
+  // set_metrics: publish a snapshot to board (as Node `index`) every
+  // kMetricsSnapshotMs, for whichever Node serves --metrics-port
+  void set_metrics(std::shared_ptr<MetricsBoard> board, size_t index) {
+    metrics_board_ = std::move(board);
+    metrics_index_ = index;
+    on_metrics_timer();
+  }
+
+  // add_metrics_listener: serve the board over HTTP from metrics_fd
+  bool add_metrics_listener(int metrics_fd) {
+    metrics_fd_ = metrics_fd;
+    return reactor_.add(metrics_fd, EPOLLIN, [this](uint32_t) { on_metrics_listener(); });
+  }
+
+  // watch_signals: print the stats table (every Node's peers) on SIGUSR1
+  // and every --stats-ms. SIGUSR1 must already be blocked in all threads,
+  // so it only ever arrives through the signalfd.
+  bool watch_signals() {
+    if (stats_ms_ > 0) reactor_.add_timer(stats_ms_, [this] { on_stats_timer(); });
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    signal_fd_ = ::signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd_ < 0) {
+      std::cerr << "signalfd() failed: " << std::strerror(errno) << "\n";
+      return false;
+    }
+    return reactor_.add(signal_fd_, EPOLLIN, [this](uint32_t) { on_signal(); });
+  }
+
+  // set_output: where print_message's batches go (shared with other Nodes)
+  void set_output(std::shared_ptr<OutputSink> output) {
+    output_ = std::move(output);
+    output_text_ = output_->wants_text();
+  }
+
+  // MessageHandler: called for every message a peer sends us. The peer may
+  // be closed from inside the handler (close_peer); framing stops there.
+  using MessageHandler = std::function<void(Peer& peer, const Message& message)>;
+
+  // on_message: replace the default handler, which prints each message
+  void on_message(MessageHandler handler) { message_handler_ = std::move(handler); }
+
+  // add_listener: accept peers from listen_fd for as long as we run
+  bool add_listener(int listen_fd) {
+    listen_fd_ = listen_fd;
+    return reactor_.add(listen_fd, EPOLLIN, [this](uint32_t) { on_listener_readable(); });
+  }
+
+  // DialCallback: gets the connected socket, or -1 if the dial failed
+  using DialCallback = std::function<void(int fd)>;
+
+  // dial: connect to peer without blocking the loop. `done` runs exactly
+  // once, from the loop, with the connected fd or with -1 after an error
+  // or after timeout_ms. The fd is not yet a Peer; the callback decides.
+  // Returns the dialing fd (for cancel_dial), or -1 if it failed at once.
+  int dial(const Endpoint& peer, int timeout_ms, DialCallback done) {
+    int fd = connect_to_peer(peer.host, peer.port);
+    if (fd < 0) {
+      reactor_.add_timer(0, [done] { done(-1); });
+      return -1;
+    }
+    Dial& dial = dials_[fd];
+    dial.name = peer.host + ":" + std::to_string(peer.port);
+    dial.done = std::move(done);
+    dial.timer = reactor_.add_timer(timeout_ms, [this, fd] { finish_dial(fd, ETIMEDOUT); });
+    // Writable means the handshake finished, one way or the other
+    if (!reactor_.add(fd, EPOLLOUT, [this, fd](uint32_t) { on_dial_ready(fd); })) {
+      int err = errno;
+      reactor_.add_timer(0, [this, fd, err] { finish_dial(fd, err); });
+    }
+    return fd;
+  }
+
+  // start_outbound: keep `target` connections to peers from `candidates`
+  // (0 = all of them). Dials run in parallel; whenever we are short, more
+  // candidates are dialed, and the surplus is cancelled once we have enough.
+  void start_outbound(const std::vector<Endpoint>& candidates, size_t target, int timeout_ms) {
+    for (const Endpoint& endpoint : candidates) {
+      Candidate candidate;
+      candidate.endpoint = endpoint;
+      candidate.name = endpoint.host + ":" + std::to_string(endpoint.port);
+      candidates_.push_back(candidate);
+    }
+    outbound_target_ = (target == 0 || target > candidates_.size()) ? candidates_.size() : target;
+    connect_timeout_ms_ = timeout_ms;
+    maintain_outbound();
+  }
+
+  // start_churn: --bench-churn; see "connection churn" below
+  void start_churn(const Endpoint& endpoint, uint64_t count, size_t parallel, int timeout_ms) {
+    churning_ = true;
+    churn_endpoint_ = endpoint;
+    churn_name_ = endpoint.host + ":" + std::to_string(endpoint.port);
+    churn_left_ = count;
+    connect_timeout_ms_ = timeout_ms;
+    message_handler_ = [this](Peer& peer, const Message& message) {
+      on_churn_message(peer, message);
+    };
+    churn_start_ns_ = churn_interval_ns_ = now_ns();
+    churn_timer_ = reactor_.add_timer(report_ms_, [this] { report_churn(); });
+    for (size_t i = 0; i < parallel && churn_left_ > 0; ++i) churn_dial();
+  }
+
+  // add_peer: take ownership of a connected socket and start reading from it
+  bool add_peer(int fd, const std::string& name, int candidate = -1) {
+    if (file_mode()) return add_transfer(fd, name, candidate);
+    if (static_cast<size_t>(fd) >= peers_.size()) peers_.resize(fd + 1);
+    Peer& peer = peers_[fd];
+    peer.fd = fd;
+    peer.name = name;
+    peer.incoming_buffer.clear();
+    peer.framing = FrameState();
+    peer.outgoing.clear();
+    peer.want_write = false;
+    peer.flush_pending = false;
+    peer.candidate = candidate;
+    peer.stats = PeerStats();
+    ++connections_opened_;
+    ++peer_count_;
+    int one = 1;
+    if (zerocopy_min_ > 0 && ::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+      peer.outgoing.enable_zerocopy(zerocopy_min_);
+    }
+    if (uring_) {
+      uring_->start_recv(fd);
+      if (ping_ && ping_fd_ < 0 && ping_seq_ == 0) start_ping(fd);
+      return true;
+    }
+    if (!reactor_.add(fd, kPeerEvents, [this, fd](uint32_t events) { on_peer_event(fd, events); })) {
+      close_peer(fd);
+      return false;
+    }
+    if (ping_ && ping_fd_ < 0 && ping_seq_ == 0) start_ping(fd);
+    return true;
+  }
+
+  void run() {
+    reactor_.run();
+    flush_output();
+    // Queued io_uring sends would be lost on exit; let them finish first
+    if (uring_) uring_->flush();
+    if (bench_tx_ && bench_sent_ > 0) report_bench_tx();
+  }
+
+  ~Node() {
+    for (Peer& peer : peers_) {
+      if (peer.fd >= 0) ::close(peer.fd);
+    }
+    if (listen_fd_ >= 0) ::close(listen_fd_);
+    if (mailbox_fd_ >= 0) ::close(mailbox_fd_);
+    if (signal_fd_ >= 0) ::close(signal_fd_);
+    if (metrics_fd_ >= 0) ::close(metrics_fd_);
+    for (auto& [fd, client] : metrics_clients_) ::close(fd);
+    for (auto& [fd, dial] : dials_) ::close(fd);
+    for (auto& [fd, transfer] : transfers_) {
+      ::close(fd);
+      for (int other : {transfer.file_fd, transfer.pipe_fds[0], transfer.pipe_fds[1]}) {
+        if (other >= 0) ::close(other);
+      }
+    }
+    if (send_file_fd_ >= 0) ::close(send_file_fd_);
+  }
+
+  // file_mode: --send-file or --recv-file; connections carry a file
+  bool file_mode() const { return send_file_fd_ >= 0 || !recv_file_path_.empty(); }
+
+ private:
+  // Dial: an outgoing connection whose handshake hasn't finished yet
+  struct Dial {
+    std::string name;
+    DialCallback done;
+    Reactor::TimerId timer = 0;
+  };
+
+  void on_dial_ready(int fd) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    finish_dial(fd, err);
+  }
+
+  // finish_dial: err == 0 means connected; the callback owns fd from here
+  void finish_dial(int fd, int err) {
+    auto it = dials_.find(fd);
+    if (it == dials_.end()) return;
+    Dial dial = std::move(it->second);
+    dials_.erase(it);
+    reactor_.cancel_timer(dial.timer);
+    reactor_.remove(fd);
+    if (err != 0) {
+      std::cerr << ("connect() to " + dial.name + " failed: " + std::strerror(err) + "\n");
+      ::close(fd);
+      fd = -1;
+    }
+    dial.done(fd);
+  }
+
+  // cancel_dial: abandon a dial still in progress (its callback won't run)
+  void cancel_dial(int fd) {
+    auto it = dials_.find(fd);
+    if (it == dials_.end()) return;
+    reactor_.cancel_timer(it->second.timer);
+    reactor_.remove(fd);
+    ::close(fd);
+    dials_.erase(it);
+  }
+
+  // -------- outbound connection manager --------
+
+  // Candidate: one --connect address and how it has been doing lately
+  struct Candidate {
+    Endpoint endpoint;
+    std::string name;
+    bool dialing = false;
+    int dial_fd = -1;     // while dialing (-1 if the dial failed at once)
+    int peer_fd = -1;     // while connected
+    int failures = 0;     // consecutive failed dials
+    int64_t retry_at = 0; // don't dial again before this (Reactor::now_ms)
+  };
+
+  static constexpr size_t kMaxParallelDials = 64;
+  static constexpr int64_t kRetryMinMs = 500;
+  static constexpr int64_t kRetryMaxMs = 30000;
+
+  // backoff_ms: 0.5s, 1s, 2s, ... up to 30s, +-20% so peers that failed
+  // together don't all retry in the same millisecond
+  int64_t backoff_ms(int failures) {
+    int64_t delay = kRetryMinMs;
+    for (int i = 1; i < failures && delay < kRetryMaxMs; ++i) delay *= 2;
+    delay = std::min(delay, kRetryMaxMs);
+    std::uniform_int_distribution<int64_t> jitter(-delay / 5, delay / 5);
+    return delay + jitter(rng_);
+  }
+
+  // maintain_outbound: dial more candidates if we are below target, or
+  // cancel surplus dials if we reached it. Called after anything changes.
+  void maintain_outbound() {
+    if (candidates_.empty() || stopping_) return;
+    if (outbound_connected_ >= outbound_target_) {
+      for (Candidate& candidate : candidates_) {
+        if (!candidate.dialing || candidate.dial_fd < 0) continue;
+        cancel_dial(candidate.dial_fd);
+        candidate.dialing = false;
+        candidate.dial_fd = -1;
+        --outbound_dialing_;
+      }
+      return;
+    }
+
+    // Dial a few more than we need, so dead candidates don't hold us up
+    size_t missing = outbound_target_ - outbound_connected_;
+    size_t max_dialing = std::min(kMaxParallelDials, 2 * missing);
+    int64_t now = Reactor::now_ms();
+    int64_t next_retry = INT64_MAX;
+    for (size_t k = 0; k < candidates_.size() && outbound_dialing_ < max_dialing; ++k) {
+      size_t index = (next_candidate_ + k) % candidates_.size();
+      Candidate& candidate = candidates_[index];
+      if (candidate.dialing || candidate.peer_fd >= 0) continue;
+      if (candidate.retry_at > now) {
+        next_retry = std::min(next_retry, candidate.retry_at);
+        continue;
+      }
+      candidate.dialing = true;
+      ++outbound_dialing_;
+      next_candidate_ = index + 1; // round-robin across calls
+      int i = static_cast<int>(index);
+      candidate.dial_fd = dial(candidate.endpoint, connect_timeout_ms_,
+                               [this, i](int fd) { on_outbound_dialed(i, fd); });
+    }
+
+    // Nothing to dial right now: come back when the next backoff expires
+    if (outbound_dialing_ == 0 && next_retry != INT64_MAX) {
+      reactor_.cancel_timer(retry_timer_);
+      retry_timer_ = reactor_.add_timer(next_retry - now, [this] { maintain_outbound(); });
+    }
+  }
+
+  void on_outbound_dialed(int index, int fd) {
+    Candidate& candidate = candidates_[index];
+    candidate.dialing = false;
+    candidate.dial_fd = -1;
+    --outbound_dialing_;
+    if (fd < 0) {
+      ++candidate.failures;
+      int64_t delay = backoff_ms(candidate.failures);
+      candidate.retry_at = Reactor::now_ms() + delay;
+      std::cerr << ("will retry " + candidate.name + " in " + std::to_string(delay) + " ms\n");
+    } else if (outbound_connected_ >= outbound_target_) {
+      ::close(fd); // lost the race; we already have enough peers
+    } else {
+      peer_status("connected to " + candidate.name + "\n");
+      candidate.failures = 0;
+      candidate.peer_fd = fd;
+      ++outbound_connected_;
+      add_peer(fd, candidate.name, index);
+      // Read stdin only once someone can receive it (matters for files)
+      watch_stdin();
+    }
+    maintain_outbound();
+  }
+
+  // on_outbound_closed: an outbound peer went away; find a replacement
+  void on_outbound_closed(int index) {
+    Candidate& candidate = candidates_[index];
+    candidate.peer_fd = -1;
+    --outbound_connected_;
+    // Don't redial the same peer instantly; others may be dialed right away
+    candidate.failures = 1;
+    candidate.retry_at = Reactor::now_ms() + backoff_ms(candidate.failures);
+    maintain_outbound();
+  }
+
+  // -------- file transfers (--send-file / --recv-file) --------
+
+  // Transfer: a connection that carries a file instead of messages
+  struct Transfer {
+    std::string name;
+    int candidate = -1;
+    std::string path;
+    off_t offset = 0;            // sending: next byte of the file to send
+    int file_fd = -1;            // receiving: the output file
+    int pipe_fds[2] = {-1, -1};  // receiving: socket -> pipe -> file
+    uint64_t received = 0;
+    int64_t started_ms = 0;
+  };
+
+  static constexpr size_t kFileChunk = 1 << 20; // bytes per sendfile()/splice()
+  static constexpr int kFileRounds = 16;        // chunks per wakeup, so others get a turn
+
+  bool open_send_file(const std::string& path) {
+    send_file_fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (send_file_fd_ < 0 || ::fstat(send_file_fd_, &st) < 0) {
+      std::cerr << "can't open " << path << ": " << std::strerror(errno) << "\n";
+      return false;
+    }
+    send_file_path_ = path;
+    send_file_size_ = st.st_size;
+    return true;
+  }
+
+  // add_transfer: start streaming the file to (or from) a new connection
+  bool add_transfer(int fd, const std::string& name, int candidate) {
+    Transfer& transfer = transfers_[fd];
+    transfer.name = name;
+    transfer.candidate = candidate;
+    transfer.started_ms = Reactor::now_ms();
+    if (send_file_fd_ >= 0) {
+      transfer.path = send_file_path_;
+      status("sending " + transfer.path + " (" + std::to_string(send_file_size_) + " bytes) to " +
+             name + "\n");
+      if (!reactor_.add(fd, EPOLLOUT, [this, fd](uint32_t) { on_send_file_writable(fd); })) {
+        end_transfer(fd, errno);
+        return false;
+      }
+      return true;
+    }
+    // Receiving: the first peer writes PATH, later ones PATH.1, PATH.2, ...
+    transfer.path = recv_file_path_;
+    if (recv_file_count_ > 0) transfer.path += "." + std::to_string(recv_file_count_);
+    ++recv_file_count_;
+    transfer.file_fd = ::open(transfer.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (transfer.file_fd < 0 || ::pipe2(transfer.pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+      end_transfer(fd, errno);
+      return false;
+    }
+    // A bigger pipe moves more per splice(); the default is 64 KiB
+    ::fcntl(transfer.pipe_fds[1], F_SETPIPE_SZ, static_cast<int>(kFileChunk));
+    if (!reactor_.add(fd, EPOLLIN | EPOLLRDHUP, [this, fd](uint32_t) { on_recv_file_readable(fd); })) {
+      end_transfer(fd, errno);
+      return false;
+    }
+    return true;
+  }
+
+  // on_send_file_writable: sendfile() as much as the socket takes
+  void on_send_file_writable(int fd) {
+    Transfer& transfer = transfers_[fd];
+    bool shrunk = false;
+    for (int round = 0; round < kFileRounds; ++round) {
+      if (transfer.offset >= send_file_size_) break;
+      size_t want = static_cast<size_t>(std::min<off_t>(send_file_size_ - transfer.offset, kFileChunk));
+      ssize_t n = ::sendfile(fd, send_file_fd_, &transfer.offset, want);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) end_transfer(fd, errno);
+        return; // EAGAIN: the socket is full; EPOLLOUT brings us back
+      }
+      if (n == 0) {
+        shrunk = true; // the file got shorter under us
+        break;
+      }
+    }
+    // Done once the whole file is queued; close() still delivers the rest
+    if (shrunk || transfer.offset >= send_file_size_) end_transfer(fd, 0);
+  }
+
+  // on_recv_file_readable: splice socket -> pipe -> file until EAGAIN
+  void on_recv_file_readable(int fd) {
+    Transfer& transfer = transfers_[fd];
+    for (int round = 0; round < kFileRounds; ++round) {
+      ssize_t n = ::splice(fd, nullptr, transfer.pipe_fds[1], nullptr, kFileChunk,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == 0) {
+        end_transfer(fd, 0); // the sender closed: the file is complete
+        return;
+      }
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        if (errno != EAGAIN) end_transfer(fd, errno);
+        return;
+      }
+      // Empty the pipe into the file (a regular file never says EAGAIN)
+      while (n > 0) {
+        ssize_t m = ::splice(transfer.pipe_fds[0], nullptr, transfer.file_fd, nullptr,
+                             static_cast<size_t>(n), SPLICE_F_MOVE);
+        if (m <= 0) {
+          if (m < 0 && errno == EINTR) continue;
+          end_transfer(fd, m < 0 ? errno : EIO);
+          return;
+        }
+        n -= m;
+        transfer.received += static_cast<uint64_t>(m);
+      }
+    }
+  }
+
+  // end_transfer: report, close everything, and (connect-only) exit once
+  // the last transfer is over
+  void end_transfer(int fd, int err) {
+    auto it = transfers_.find(fd);
+    if (it == transfers_.end()) return;
+    Transfer transfer = std::move(it->second);
+    transfers_.erase(it);
+    uint64_t bytes = send_file_fd_ >= 0 ? static_cast<uint64_t>(transfer.offset) : transfer.received;
+    if (err == 0) {
+      int64_t ms = std::max<int64_t>(Reactor::now_ms() - transfer.started_ms, 1);
+      std::string rate = std::to_string(bytes / 1000 / static_cast<uint64_t>(ms)) + " MB/s";
+      status((send_file_fd_ >= 0 ? "sent " : "received ") + std::to_string(bytes) + " bytes " +
+             (send_file_fd_ >= 0 ? "to " : "from ") + transfer.name + " (" + transfer.path + ") in " +
+             std::to_string(ms) + " ms, " + rate + "\n");
+    } else {
+      std::cerr << ("file transfer with " + transfer.name + " failed after " + std::to_string(bytes) +
+                    " bytes: " + std::strerror(err) + "\n");
+    }
+    reactor_.remove(fd);
+    ::close(fd);
+    if (transfer.file_fd >= 0) ::close(transfer.file_fd);
+    if (transfer.pipe_fds[0] >= 0) ::close(transfer.pipe_fds[0]);
+    if (transfer.pipe_fds[1] >= 0) ::close(transfer.pipe_fds[1]);
+    if (listen_fd_ < 0 && transfers_.empty() && outbound_dialing_ == 0) stop_when_flushed();
+    if (transfer.candidate >= 0) on_outbound_closed(transfer.candidate);
+  }
+
+  void wake() {
+    uint64_t one = 1;
+    ssize_t n = ::write(mailbox_fd_, &one, sizeof(one));
+    (void)n; // a full counter still wakes the reader
+  }
+
+  // on_mailbox: run whatever other threads posted to us
+  void on_mailbox() {
+    uint64_t count;
+    ssize_t n = ::read(mailbox_fd_, &count, sizeof(count));
+    (void)n;
+    std::vector<PostedLine> lines;
+    std::vector<PostedStats> stats;
+    bool stop;
+    {
+      std::lock_guard<std::mutex> lock(mailbox_mutex_);
+      lines.swap(mailbox_lines_);
+      stats.swap(mailbox_stats_);
+      stop = mailbox_stop_;
+    }
+    for (const PostedLine& line : lines) broadcast(line.chunk, line.messages);
+    for (const PostedStats& posted : stats) on_stats_request(posted.request, posted.index);
+    if (stop) stop_when_flushed();
+  }
+
+  // Accept every connection that is waiting, until the kernel says EAGAIN.
+  // One wakeup can then drain a whole burst of reconnecting peers.
+  void on_listener_readable() {
+    while (true) {
+      sockaddr_in peer_addr;
+      socklen_t peer_len = sizeof(peer_addr);
+      int conn_fd = ::accept4(listen_fd_, reinterpret_cast<sockaddr*>(&peer_addr), &peer_len,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (conn_fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return; // queue drained
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        pause_listener(listen_fd_, [this](uint32_t) { on_listener_readable(); });
+        return;
+      }
+      std::string name = address_text(peer_addr);
+      peer_status("connected to peer " + name + "\n");
+      add_peer(conn_fd, name);
+    }
+  }
+
+  // pause_listener: accept4() failed for want of descriptors or memory
+  // (EMFILE, ENFILE, ENOBUFS, ENOMEM...). The connection stays queued, so
+  // the level-triggered listener would fire again at once and spin; take
+  // it off the loop for kAcceptBackoffMs instead. The error is logged at
+  // most once per kAcceptLogMs, with a count of the ones left out.
+  void pause_listener(int listen_fd, Reactor::Handler handler) {
+    int64_t now = Reactor::now_ms();
+    if (now - accept_error_logged_ms_ >= kAcceptLogMs) {
+      std::string text = std::string("accept4() failed: ") + std::strerror(errno);
+      if (accept_errors_unlogged_ > 0) {
+        text += " (and " + std::to_string(accept_errors_unlogged_) + " more)";
+      }
+      std::cerr << text + "; pausing accepts\n";
+      accept_error_logged_ms_ = now;
+      accept_errors_unlogged_ = 0;
+    } else {
+      ++accept_errors_unlogged_;
+    }
+    reactor_.remove(listen_fd);
+    reactor_.add_timer(kAcceptBackoffMs, [this, listen_fd, handler] {
+      reactor_.add(listen_fd, EPOLLIN, handler);
+    });
+  }
+
+  // poll_stdin: read stdin once per loop iteration until it closes
+  void poll_stdin() {
+    reactor_.add_timer(0, [this] {
+      if (on_stdin() && !stdin_paused_) poll_stdin();
+    });
+  }
+
+  // input_ready: read more of stdin (or generate more --bench-tx messages)?
+  bool input_ready() {
+    if (bench_tx_ && peer_count_ == 0) return false; // nobody to measure yet
+    return peers_have_room();
+  }
+
+  // peers_have_room: stdin is read only while some peer's queue is below
+  // half the high-water mark. A piped file is then paced by the fastest
+  // peer instead of piling up; slower peers still hit --send-hwm.
+  bool peers_have_room() {
+    if (peer_count_ == 0) return true;
+    for (const Peer& peer : peers_) {
+      if (peer.fd < 0) continue;
+      size_t queued = uring_ ? uring_->queued(peer.fd) : peer.outgoing.bytes();
+      if (queued < send_high_water_ / 2) return true;
+    }
+    return false;
+  }
+
+  // pause_stdin / resume_stdin: stop and restart reading (see peers_have_room)
+  void pause_stdin() {
+    stdin_paused_ = true;
+    if (!stdin_polled_) reactor_.remove(0);
+  }
+  void resume_stdin() {
+    stdin_paused_ = false;
+    if (stdin_polled_) poll_stdin();
+    else reactor_.add(0, EPOLLIN, [this](uint32_t) { on_stdin(); });
+  }
+
+  // on_stdin: read() one block of stdin and send every complete line in it
+  // to every peer as a single batch: one message chunk, shared by all
+  // peers and sibling Nodes. A partial last line waits for the next block.
+  // Returns false once stdin is closed.
+  bool on_stdin() {
+    if (!input_ready()) {
+      pause_stdin(); // before_wait resumes it
+      return true;
+    }
+    if (bench_tx_) return on_bench_tx();
+    RecvBuffer& in = stdin_buffer_;
+    size_t want = std::min(kStdinChunk, std::max<size_t>(send_high_water_ / 2, 4096));
+    ssize_t n = ::read(0, in.prepare(want), want);
+    ++syscall_count;
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return true;
+    if (n < 0) std::cerr << "read(stdin) failed: " << std::strerror(errno) << "\n";
+    bool closed = n <= 0;
+    if (!closed) in.commit(static_cast<size_t>(n));
+
+    std::string batch;
+    size_t used = 0;     // bytes of `in` that made it into the batch
+    size_t messages = 0; // ... as this many messages
+    if (!bitcoin_framing_) {
+      // Lines already end in '\n', our framing: send them exactly as read
+      const void* last = ::memrchr(in.data(), '\n', in.size());
+      if (last != nullptr) used = static_cast<size_t>(static_cast<const char*>(last) - in.data()) + 1;
+      batch.assign(in.data(), used);
+      messages = static_cast<size_t>(std::count(batch.begin(), batch.end(), '\n'));
+    } else {
+      newlines_.clear();
+      scan_delimiters(in.data(), in.size(), '\n', &newlines_);
+      for (size_t newline : newlines_) {
+        append_message(&batch, std::string_view(in.data() + used, newline - used));
+        used = newline + 1;
+      }
+      messages = newlines_.size();
+    }
+    // At the end, a last line without '\n' still counts
+    if (closed && used < in.size()) {
+      append_message(&batch, std::string_view(in.data() + used, in.size() - used));
+      used = in.size();
+      ++messages;
+    }
+    in.consume(used);
+
+    if (!batch.empty()) {
+      auto message = std::make_shared<const std::string>(std::move(batch));
+      for (Node* sibling : siblings_) sibling->post_line(message, messages);
+      broadcast(message, messages);
+    }
+    if (closed) {
+      status("stdin closed; goodbye\n");
+      reactor_.remove(0);
+      for (Node* sibling : siblings_) sibling->post_stop();
+      stop_when_flushed();
+      return false;
+    }
+    return true;
+  }
+
+  // -------- benchmarks (--bench-tx / --bench-rx) --------
+
+  // on_bench_tx: one batch of copies of the benchmark message for every
+  // peer, through the normal send path. Called in place of reading stdin,
+  // so it is paced the same way. Returns false once all have been sent.
+  bool on_bench_tx() {
+    if (bench_sent_ == 0) bench_start_ = UsageSample::now();
+    size_t per_batch = std::max<size_t>(1, kBenchBatchBytes / bench_message_.size());
+    size_t count = std::min(per_batch, bench_count_ - bench_sent_);
+    std::string batch;
+    batch.reserve(count * bench_message_.size());
+    for (size_t i = 0; i < count; ++i) batch.append(bench_message_);
+    bench_sent_ += count;
+    broadcast(std::make_shared<const std::string>(std::move(batch)), count);
+    if (bench_sent_ < bench_count_) return true;
+    stop_when_flushed(); // run() reports once everything is written
+    return false;
+  }
+
+  // report_bench_tx: what the sockets took, summed over peers (including
+  // ones dropped on the way); a message counts once per peer it reached
+  void report_bench_tx() {
+    MetricsSnapshot sent = closed_totals_;
+    for (const Peer& peer : peers_) {
+      if (peer.fd >= 0) add_totals(&sent, peer);
+    }
+    uint64_t messages = sent.bytes_out / bench_message_.size();
+    status(bench_report("bench-tx (sent, all peers)", messages, messages * bench_size_,
+                        bench_start_, UsageSample::now()));
+  }
+
+  // finish_bench_rx: the last sender left; report what it sent us
+  void finish_bench_rx() {
+    if (bench_rx_messages_ > 0) {
+      status(bench_report("bench-rx", bench_rx_messages_, bench_rx_bytes_, bench_start_,
+                          UsageSample::now()));
+    }
+    bench_rx_messages_ = 0;
+    bench_rx_bytes_ = 0;
+    if (listen_fd_ < 0) stop_when_flushed();
+  }
+
+  // -------- latency (--ping / --echo) --------
+  // The pinging side keeps one probe in flight to its first peer:
+  // "ping <seq> <sent_ns>", which the echoing side returns as "pong ...".
+  // Each round trip goes through the same queues, batching and event loop
+  // as any other message, so it measures what relayed messages see.
+
+  // on_latency_message: answer probes, time replies, print anything else
+  void on_latency_message(Peer& peer, const Message& message) {
+    std::string_view body;
+    if (echo_ && probe_body(message, "ping", &body)) {
+      std::string reply;
+      append_message(&reply, "pong " + std::string(body));
+      send_to(peer, std::make_shared<const std::string>(std::move(reply)));
+    } else if (peer.fd == ping_fd_ && probe_body(message, "pong", &body)) {
+      on_pong(body);
+    } else {
+      print_message(peer, message);
+    }
+  }
+
+  // probe_body: "<seq> <sent_ns>" if message is a probe of this kind
+  bool probe_body(const Message& message, std::string_view kind, std::string_view* body) const {
+    if (bitcoin_framing_) {
+      if (message.command != kind) return false;
+      *body = message.payload;
+      return true;
+    }
+    std::string_view line = message.payload;
+    if (line.size() <= kind.size() || line.substr(0, kind.size()) != kind ||
+        line[kind.size()] != ' ') {
+      return false;
+    }
+    *body = line.substr(kind.size() + 1);
+    return true;
+  }
+
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void start_ping(int fd) {
+    ping_fd_ = fd;
+    ping_timer_ = reactor_.add_timer(report_ms_, [this] { report_ping(); });
+    send_probe();
+  }
+
+  void send_probe() {
+    std::string probe;
+    append_message(&probe, "ping " + std::to_string(ping_seq_) + " " + std::to_string(now_ns()));
+    send_to(peers_[ping_fd_], std::make_shared<const std::string>(std::move(probe)));
+  }
+
+  // on_pong: record the round trip and send the next probe
+  void on_pong(std::string_view body) {
+    uint64_t seq = 0;
+    uint64_t sent_ns = 0;
+    const char* end = body.data() + body.size();
+    auto [next, err] = std::from_chars(body.data(), end, seq);
+    if (err != std::errc() || next == end || seq != ping_seq_) return; // not ours
+    if (std::from_chars(next + 1, end, sent_ns).ec != std::errc()) return;
+    uint64_t rtt = now_ns() - sent_ns;
+    ping_interval_.record(rtt);
+    ping_total_.record(rtt);
+    ping_all_.record(rtt);
+    if (++ping_seq_ == ping_count_) {
+      finish_ping();
+      return;
+    }
+    send_probe();
+  }
+
+  // report_ping: percentiles for the last --report-ms, then start over
+  void report_ping() {
+    if (ping_interval_.count() > 0) status(latency_report("rtt", ping_interval_));
+    ping_interval_.reset();
+    ping_timer_ = reactor_.add_timer(report_ms_, [this] { report_ping(); });
+  }
+
+  // finish_ping: all probes answered (or the peer left); report totals
+  void finish_ping() {
+    if (ping_fd_ < 0) return;
+    ping_fd_ = -1;
+    reactor_.cancel_timer(ping_timer_);
+    status(latency_report("rtt total", ping_total_));
+    stop_when_flushed();
+  }
+
+  // -------- connection churn (--bench-churn) --------
+  // Keeps --churn-parallel connections to one endpoint going until
+  // --bench-churn have been made. Each connects, sends one probe, and
+  // closes when the (--echo) listener answers it, so one round covers
+  // the listener's accept, first read, reply and teardown. Latencies are
+  // from connect(): "connect" to the end of the TCP handshake,
+  // "accepted" to the answer.
+
+  void churn_dial() {
+    --churn_left_;
+    ++churn_active_;
+    uint64_t started = now_ns();
+    dial(churn_endpoint_, connect_timeout_ms_,
+         [this, started](int fd) { on_churn_connected(fd, started); });
+  }
+
+  void on_churn_connected(int fd, uint64_t started) {
+    if (fd < 0) {
+      churn_next();
+      return;
+    }
+    uint64_t connected = now_ns() - started;
+    churn_connect_.record(connected);
+    churn_connect_total_.record(connected);
+    if (!add_peer(fd, churn_name_)) return; // closed, and churn_next() ran
+    std::string probe;
+    append_message(&probe, "ping 0 " + std::to_string(started));
+    send_to(peers_[fd], std::make_shared<const std::string>(std::move(probe)));
+  }
+
+  // on_churn_message: the answer to our probe; this connection is done
+  void on_churn_message(Peer& peer, const Message& message) {
+    std::string_view body;
+    if (!probe_body(message, "pong", &body)) return;
+    uint64_t started = 0;
+    size_t space = body.find(' ');
+    if (space == std::string_view::npos) return;
+    std::from_chars(body.data() + space + 1, body.data() + body.size(), started);
+    uint64_t accepted = now_ns() - started;
+    churn_accept_.record(accepted);
+    churn_accept_total_.record(accepted);
+    ++churn_done_;
+    close_peer(peer.fd);
+  }
+
+  // churn_next: a connection ended (answered or not); start the next
+  void churn_next() {
+    --churn_active_;
+    ++churn_ended_;
+    if (churn_left_ > 0 && !stopping_) {
+      churn_dial();
+    } else if (churn_active_ == 0) {
+      finish_churn();
+    }
+  }
+
+  // report_churn: rate and latencies for the last --report-ms
+  void report_churn() {
+    uint64_t now = now_ns();
+    double seconds = (now - churn_interval_ns_) / 1e9;
+    char line[128];
+    std::snprintf(line, sizeof(line), "churn: %.0f connections/s\n",
+                  (churn_done_ - churn_interval_done_) / seconds);
+    status(line + latency_report("  connect", churn_connect_, "connections") +
+           latency_report("  accepted", churn_accept_, "connections"));
+    churn_connect_.reset();
+    churn_accept_.reset();
+    if (churn_steady_ns_ == 0) { // the first interval is warm-up
+      churn_steady_ns_ = now;
+      churn_steady_done_ = churn_done_;
+    }
+    churn_interval_ns_ = now;
+    churn_interval_done_ = churn_done_;
+    churn_timer_ = reactor_.add_timer(report_ms_, [this] { report_churn(); });
+  }
+
+  // finish_churn: every connection has been made; report the totals
+  void finish_churn() {
+    churning_ = false;
+    reactor_.cancel_timer(churn_timer_);
+    uint64_t now = now_ns();
+    double seconds = (now - churn_start_ns_) / 1e9;
+    double steady = churn_steady_ns_ == 0 || now == churn_steady_ns_
+                        ? churn_done_ / seconds
+                        : (churn_done_ - churn_steady_done_) / ((now - churn_steady_ns_) / 1e9);
+    char line[192];
+    std::snprintf(line, sizeof(line),
+                  "churn total: %llu connections, %llu failed, in %.3f s: %.0f connections/s, "
+                  "steady state %.0f connections/s\n",
+                  static_cast<unsigned long long>(churn_done_),
+                  static_cast<unsigned long long>(churn_ended_ - churn_done_),
+                  seconds, churn_done_ / seconds, steady);
+    status(line + latency_report("  connect", churn_connect_total_, "connections") +
+           latency_report("  accepted", churn_accept_total_, "connections"));
+    stop_when_flushed();
+  }
+
+  // append_message: turn one typed line into bytes for the wire
+  void append_message(std::string* out, std::string_view line) const {
+    if (!bitcoin_framing_) {
+      // Add the newline that marks the end of our message
+      out->append(line);
+      out->push_back('\n');
+      return;
+    }
+    // "<command> <payload>": the first word is the command
+    size_t space = line.find(' ');
+    std::string_view command = line.substr(0, space);
+    std::string_view payload = space == std::string_view::npos ? std::string_view() : line.substr(space + 1);
+    append_bitcoin_message(out, command, payload);
+  }
+
+  // broadcast: send one framed message to every peer of this Node
+  // (`messages` says how many the chunk holds, for the stats)
+  void broadcast(const SendQueue::Chunk& message, size_t messages = 1) {
+    for (Peer& peer : peers_) {
+      if (peer.fd >= 0) send_to(peer, message, messages);
+    }
+  }
+
+  // send_to: queue a message for one peer. It goes out with the peer's next
+  // batch: at the end of this loop iteration (or after --coalesce-ms), or
+  // at once when --coalesce-bytes are queued. Nothing here blocks, so a
+  // slow peer only grows its own queue; once that passes the high-water
+  // mark the peer is dropped instead. Returns false if the peer was closed.
+  bool send_to(Peer& peer, const SendQueue::Chunk& message, size_t messages = 1) {
+    size_t queued = uring_ ? uring_->queued(peer.fd) : peer.outgoing.bytes();
+    if (queued > 0 && queued + message->size() > send_high_water_) {
+      std::cerr << ("peer " + peer.name + " is not keeping up (" + std::to_string(queued) +
+                    " bytes queued); disconnecting\n");
+      ++dropped_send_hwm_;
+      close_peer(peer.fd);
+      return false;
+    }
+    peer.stats.messages_out += messages;
+    peer.stats.send_queue_high = std::max(peer.stats.send_queue_high, queued + message->size());
+    if (uring_) {
+      uring_->send(peer.fd, message->data(), message->size());
+      return true;
+    }
+    peer.outgoing.push(message);
+    if (peer.want_write) return true; // EPOLLOUT will flush it
+    if (peer.outgoing.bytes() >= coalesce_bytes_) return flush_peer(peer);
+    if (!peer.flush_pending) {
+      peer.flush_pending = true;
+      dirty_.push_back(peer.fd);
+      if (coalesce_ms_ > 0 && !coalesce_timer_armed_) {
+        coalesce_timer_armed_ = true;
+        reactor_.add_timer(coalesce_ms_, [this] {
+          coalesce_timer_armed_ = false;
+          flush_dirty();
+        });
+      }
+    }
+    return true;
+  }
+
+  // flush_dirty: flush every peer that queued messages since the last batch
+  void flush_dirty() {
+    std::vector<int> dirty;
+    dirty.swap(dirty_);
+    for (int fd : dirty) {
+      Peer& peer = peers_[fd];
+      if (peer.fd == fd && peer.flush_pending) flush_peer(peer);
+    }
+  }
+
+  // before_wait: the loop is about to sleep; send what this iteration queued
+  void before_wait() {
+    if (uring_ && uring_->backlogged()) uring_->reap();
+    if (coalesce_ms_ == 0) flush_dirty();
+    if (uring_) uring_->submit();
+    flush_output();
+    if (stdin_paused_ && input_ready()) resume_stdin();
+  }
+
+  // flush_peer: write queued bytes; ask for EPOLLOUT only while some remain
+  bool flush_peer(Peer& peer) {
+    peer.flush_pending = false;
+    if (!peer.outgoing.flush(peer.fd)) {
+      on_peer_closed(peer.fd, -errno);
+      return false;
+    }
+    bool want_write = !peer.outgoing.empty();
+    if (want_write != peer.want_write) {
+      peer.want_write = want_write;
+      reactor_.modify(peer.fd, want_write ? kPeerEvents | EPOLLOUT : kPeerEvents);
+    }
+    if (!want_write && stopping_) stop_if_flushed();
+    return true;
+  }
+
+  // stop_when_flushed: stop the loop once every queued message is written,
+  // or after kStopLingerMs so a peer that never reads can't keep us running
+  void stop_when_flushed() {
+    if (stopping_) return;
+    stopping_ = true;
+    reactor_.add_timer(kStopLingerMs, [this] { reactor_.stop(); });
+    stop_if_flushed();
+  }
+
+  void stop_if_flushed() {
+    for (const Peer& peer : peers_) {
+      if (peer.fd >= 0 && !peer.outgoing.idle()) return;
+    }
+    reactor_.stop();
+  }
+
+  void on_peer_event(int fd, uint32_t events) {
+    Peer& peer = peers_[fd];
+    if ((events & EPOLLERR) && peer.outgoing.zerocopy_inflight() > 0) {
+      peer.outgoing.reap_zerocopy(fd); // the error queue holds MSG_ZEROCOPY completions
+      if (stopping_) stop_if_flushed();
+    }
+    if ((events & EPOLLOUT) && !flush_peer(peer)) return;
+    if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) on_peer_readable(fd);
+  }
+
+  // If the socket has data, read some bytes and print full lines as they arrive.
+  // recv() writes straight into the peer's buffer; no stack chunk to copy.
+  void on_peer_readable(int fd) {
+    Peer& peer = peers_[fd];
+    // When the framing knows a large payload is coming, read it in one go
+    size_t want = std::min(std::max(kRecvChunk, peer.framing.wanted), kMaxRecvChunk);
+    char* dst = peer.incoming_buffer.prepare(want);
+    ssize_t n = ::recv(fd, dst, want, 0);
+    ++syscall_count;
+    ++peer.stats.recv_calls;
+    if (n == 0) {
+      on_peer_closed(fd, 0);
+      return;
+    }
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) return; // epoll will report it again
+      on_peer_closed(fd, -errno);
+      return;
+    }
+    peer.incoming_buffer.commit(static_cast<size_t>(n));
+    note_received(peer, static_cast<size_t>(n));
+    frame_messages(peer);
+  }
+
+  // on_peer_bytes: new bytes from an io_uring buffer (it goes back to the
+  // kernel after this call, so the bytes are copied into our buffer)
+  void on_peer_bytes(int fd, const char* data, size_t len) {
+    Peer& peer = peers_[fd];
+    peer.incoming_buffer.append(data, len);
+    ++peer.stats.recv_calls;
+    note_received(peer, len);
+    frame_messages(peer);
+  }
+
+  void note_received(Peer& peer, size_t len) {
+    peer.stats.bytes_in += len;
+    peer.stats.recv_buffer_high = std::max(peer.stats.recv_buffer_high, peer.incoming_buffer.size());
+  }
+
+  // frame_messages: hand every complete message in the peer's buffer to
+  // the handler; a peer that breaks the framing is disconnected
+  void frame_messages(Peer& peer) {
+    auto handle = [this, &peer](const Message& message) { return deliver(peer, message); };
+    FrameResult result =
+        bitcoin_framing_
+            ? frame_bitcoin_messages(peer.incoming_buffer, &peer.framing, &frame_scratch_, handle)
+            : frame_lines(peer.incoming_buffer, &peer.framing, &frame_scratch_, handle);
+    if (result == FrameResult::kBadChecksum) {
+      std::cerr << ("peer " + peer.name + " sent a bad checksum; disconnecting\n");
+      close_peer(peer.fd);
+    } else if (result == FrameResult::kBadHeader) {
+      std::cerr << ("peer " + peer.name + " sent a bad header; disconnecting\n");
+      close_peer(peer.fd);
+    }
+  }
+
+  // deliver: hand one message to the handler. Returns false if the handler
+  // closed the peer, whose buffer is then gone.
+  bool deliver(Peer& peer, const Message& message) {
+    int fd = peer.fd;
+    ++peer.stats.messages_in;
+    if (message_handler_) {
+      message_handler_(peer, message);
+    } else {
+      print_message(peer, message);
+    }
+    return peer.fd == fd;
+  }
+
+  // print_message: the default handler. Messages are formatted into one
+  // batch buffer that goes to the output sink in a single write() at the
+  // end of the loop iteration (or sooner, once it gets big).
+  void print_message(const Peer& peer, const Message& message) {
+    ++output_messages_;
+    output_bytes_ += message.payload.size();
+    if (!output_text_) return;
+    std::string& text = output_batch_;
+    text.append("[").append(peer.name).append("] ");
+    if (bitcoin_framing_) {
+      text.append(message.command).append(" (").append(std::to_string(message.payload.size())).append(" bytes)");
+      if (!message.payload.empty()) {
+        text.push_back(' ');
+        append_printable(&text, message.payload);
+      }
+    } else {
+      text.append(message.payload);
+    }
+    text.push_back('\n');
+    if (text.size() >= kOutputBatchBytes) flush_output();
+  }
+
+  // flush_output: hand the batch so far to the sink
+  void flush_output() {
+    if (output_messages_ == 0) return;
+    if (!output_batch_.empty()) output_->write(output_batch_.data(), output_batch_.size());
+    output_->count(output_messages_, output_bytes_);
+    output_batch_.clear();
+    output_messages_ = 0;
+    output_bytes_ = 0;
+  }
+
+  // status: a line about connections, always on stdout. Received messages
+  // printed before it go out first, so the order on the terminal is right.
+  void status(const std::string& text) {
+    flush_output();
+    std::cout << text << std::flush;
+  }
+
+  // -------- stats (SIGUSR1 / --stats-ms) --------
+
+  // The table covers every Node's peers but is printed once, by the
+  // Node watching for SIGUSR1. It fills in its own rows, then asks each
+  // sibling for theirs through its mailbox; the last to answer hands the
+  // request back (index 0), and the table is printed from this thread.
+
+  void on_signal() {
+    signalfd_siginfo info;
+    while (::read(signal_fd_, &info, sizeof(info)) == sizeof(info)) {
+    }
+    dump_stats();
+  }
+
+  void on_stats_timer() {
+    dump_stats();
+    reactor_.add_timer(stats_ms_, [this] { on_stats_timer(); });
+  }
+
+  // dump_stats: start gathering the table
+  void dump_stats() {
+    auto request = std::make_shared<StatsRequest>();
+    request->collector = this;
+    request->rows.resize(siblings_.size() + 1);
+    request->rows[0] = stats_rows();
+    request->pending = siblings_.size();
+    if (siblings_.empty()) print_stats(*request);
+    for (size_t i = 0; i < siblings_.size(); ++i) siblings_[i]->post_stats(request, i + 1);
+  }
+
+  // on_stats_request: add our rows (or, back at the collector, print)
+  void on_stats_request(const std::shared_ptr<StatsRequest>& request, size_t index) {
+    if (index == 0) {
+      print_stats(*request);
+      return;
+    }
+    std::string rows = stats_rows();
+    bool last;
+    {
+      std::lock_guard<std::mutex> lock(request->mutex);
+      request->rows[index] = std::move(rows);
+      last = --request->pending == 0;
+    }
+    if (last) request->collector->post_stats(request, 0);
+  }
+
+  void print_stats(StatsRequest& request) {
+    char header[320];
+    std::snprintf(header, sizeof(header),
+                  "%-21s %11s %9s %8s %9s %12s %9s %8s %8s %9s %8s %6s %6s %7s %7s %9s %9s %12s "
+                  "%9s\n",
+                  "peer", "bytes in", "msgs in", "recvs", "rbuf max", "bytes out", "msgs out",
+                  "sends", "partial", "sendq max", "rtt us", "cwnd", "mss", "retrans", "unacked",
+                  "notsent", "peer wnd", "rate B/s", "behind ms");
+    std::string table = header;
+    std::lock_guard<std::mutex> lock(request.mutex);
+    for (const std::string& rows : request.rows) table += rows;
+    if (table.size() == std::strlen(header)) table += "(no peers)\n";
+    status(table);
+  }
+
+  // stats_rows: one table row per peer connected to this Node. The last
+  // columns are what check_slow_peer judges by: "peer wnd" is "-" where
+  // the kernel doesn't report it, "behind ms" is how long the peer has
+  // been behind (0: it isn't)
+  std::string stats_rows() {
+    std::string rows;
+    int64_t now = Reactor::now_ms();
+    for (const Peer& peer : peers_) {
+      if (peer.fd < 0) continue;
+      const PeerStats& in = peer.stats;
+      const SendStats& out = uring_ ? uring_->send_stats(peer.fd) : peer.outgoing.stats();
+      char window[16] = "-";
+      if (in.window_known) std::snprintf(window, sizeof(window), "%u", in.peer_window);
+      long long behind = in.slow_since_ms > 0 ? now - in.slow_since_ms : 0;
+      char row[400];
+      std::snprintf(row, sizeof(row),
+                    "%-21s %11llu %9llu %8llu %9zu %12llu %9llu %8llu %8llu %9zu %8u %6u %6u %7u "
+                    "%7u %9u %9s %12llu %9lld\n",
+                    peer.name.c_str(), static_cast<unsigned long long>(in.bytes_in),
+                    static_cast<unsigned long long>(in.messages_in),
+                    static_cast<unsigned long long>(in.recv_calls), in.recv_buffer_high,
+                    static_cast<unsigned long long>(out.bytes),
+                    static_cast<unsigned long long>(in.messages_out),
+                    static_cast<unsigned long long>(out.calls),
+                    static_cast<unsigned long long>(out.partial), in.send_queue_high, in.rtt_us,
+                    in.cwnd, in.mss, in.retransmits, in.unacked, in.notsent, window,
+                    static_cast<unsigned long long>(in.delivery_rate), behind);
+      rows += row;
+    }
+    return rows;
+  }
+
+  // -------- TCP_INFO sampling (--tcp-info-ms / --slow-peer-ms) --------
+
+  // sample_tcp_info: one getsockopt(TCP_INFO) per peer into its stats,
+  // then check whether it is keeping up
+  void sample_tcp_info() {
+    int64_t now = Reactor::now_ms();
+    for (Peer& peer : peers_) {
+      if (peer.fd < 0) continue;
+      tcp_info info;
+      std::memset(&info, 0, sizeof(info));
+      socklen_t len = sizeof(info); // older kernels fill in less
+      if (::getsockopt(peer.fd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) continue;
+      PeerStats& stats = peer.stats;
+      stats.rtt_us = info.tcpi_rtt;
+      stats.cwnd = info.tcpi_snd_cwnd;
+      stats.mss = info.tcpi_snd_mss;
+      stats.retransmits = info.tcpi_total_retrans;
+      stats.unacked = info.tcpi_unacked;
+      stats.notsent = info.tcpi_notsent_bytes;
+      stats.delivery_rate = info.tcpi_delivery_rate;
+      stats.window_known = len >= offsetof(tcp_info, tcpi_snd_wnd) + sizeof(info.tcpi_snd_wnd);
+      stats.peer_window = info.tcpi_snd_wnd;
+      if (stats.rtt_us > 0) tcp_rtt_.record(uint64_t{stats.rtt_us} * 1000);
+      if (slow_peer_ms_ > 0) check_slow_peer(peer, now);
+    }
+    reactor_.add_timer(tcp_info_ms_, [this] { sample_tcp_info(); });
+  }
+
+  // check_slow_peer: a peer falls behind when what we have queued for it
+  // would take more than --slow-peer-ms to drain at the rate the kernel
+  // is delivering to it, or when it has closed its receive window (its
+  // application isn't reading). One that stays behind for --slow-peer-ms
+  // is dropped, long before a slow link fills --send-hwm.
+  void check_slow_peer(Peer& peer, int64_t now) {
+    const PeerStats& stats = peer.stats;
+    size_t queued = uring_ ? uring_->queued(peer.fd) : peer.outgoing.bytes();
+    size_t backlog = queued + stats.notsent;
+    bool behind = false;
+    if (backlog > 0) {
+      double rate = static_cast<double>(stats.delivery_rate);
+      if (rate == 0 && stats.rtt_us > 0) rate = 1e6 * stats.cwnd * stats.mss / stats.rtt_us;
+      behind = (stats.window_known && stats.peer_window == 0) ||
+               (rate > 0 && backlog * 1000.0 / rate > slow_peer_ms_);
+    }
+    if (!behind) {
+      peer.stats.slow_since_ms = 0;
+      return;
+    }
+    if (stats.slow_since_ms == 0) {
+      peer.stats.slow_since_ms = now;
+      return;
+    }
+    if (now - stats.slow_since_ms < slow_peer_ms_) return;
+    std::cerr << ("peer " + peer.name + " is too slow (" + std::to_string(backlog) +
+                  " bytes behind, rtt " + std::to_string(stats.rtt_us) + " us, window " +
+                  (stats.window_known ? std::to_string(stats.peer_window) : "?") + ", rate " +
+                  std::to_string(stats.delivery_rate) + " B/s); disconnecting\n");
+    ++dropped_slow_;
+    close_peer(peer.fd);
+  }
+
+  // -------- metrics (--metrics-port) --------
+  // Every Node publishes a snapshot of its counters on a timer; the Node
+  // with the metrics listener renders a scrape from the board. A scrape
+  // is a tiny HTTP exchange on a non-blocking socket in this same loop:
+  // read the request, queue the page, close once it is written.
+
+  // MetricsClient: one scrape in progress
+  struct MetricsClient {
+    std::string request;
+    SendQueue response;
+  };
+
+  // add_totals: fold one peer's counters into *totals
+  void add_totals(MetricsSnapshot* totals, const Peer& peer) {
+    const SendStats& out = uring_ ? uring_->send_stats(peer.fd) : peer.outgoing.stats();
+    totals->messages_in += peer.stats.messages_in;
+    totals->messages_out += peer.stats.messages_out;
+    totals->bytes_in += peer.stats.bytes_in;
+    totals->bytes_out += out.bytes;
+    totals->recv_calls += peer.stats.recv_calls;
+    totals->send_calls += out.calls;
+    totals->partial_sends += out.partial;
+  }
+
+  void on_metrics_timer() {
+    snapshot_metrics();
+    reactor_.add_timer(kMetricsSnapshotMs, [this] { on_metrics_timer(); });
+  }
+
+  // snapshot_metrics: copy our counters to the board (nothing else)
+  void snapshot_metrics() {
+    MetricsSnapshot snapshot = closed_totals_;
+    snapshot.peers = peer_count_;
+    snapshot.connections_opened = connections_opened_;
+    snapshot.connections_closed = connections_closed_;
+    snapshot.dropped_send_hwm = dropped_send_hwm_;
+    snapshot.dropped_slow = dropped_slow_;
+    for (const Peer& peer : peers_) {
+      if (peer.fd < 0) continue;
+      add_totals(&snapshot, peer);
+      snapshot.recv_buffer_bytes += peer.incoming_buffer.capacity();
+      snapshot.send_queue_bytes += uring_ ? uring_->queued(peer.fd) : peer.outgoing.bytes();
+    }
+    snapshot.tcp_rtt = tcp_rtt_;
+    snapshot.ping_rtt = ping_all_;
+    metrics_board_->publish(metrics_index_, std::move(snapshot));
+  }
+
+  void on_metrics_listener() {
+    while (true) {
+      int fd = ::accept4(metrics_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return; // drained
+        if (errno == EINTR || errno == ECONNABORTED) continue;
+        pause_listener(metrics_fd_, [this](uint32_t) { on_metrics_listener(); });
+        return;
+      }
+      metrics_clients_[fd];
+      if (!reactor_.add(fd, EPOLLIN, [this, fd](uint32_t events) { on_metrics_client(fd, events); })) {
+        close_metrics_client(fd);
+      }
+    }
+  }
+
+  void on_metrics_client(int fd, uint32_t events) {
+    MetricsClient& client = metrics_clients_[fd];
+    if (events & EPOLLOUT) {
+      if (!client.response.flush(fd) || client.response.empty()) close_metrics_client(fd);
+      return;
+    }
+    char buf[2048];
+    ssize_t n = ::recv(fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) return;
+    if (n <= 0 || client.request.size() + n > kMaxMetricsRequest) {
+      close_metrics_client(fd);
+      return;
+    }
+    client.request.append(buf, static_cast<size_t>(n));
+    if (client.request.find("\r\n\r\n") == std::string::npos) return; // headers not all here
+    std::string_view request(client.request);
+    std::string body;
+    const char* code = "404 Not Found";
+    if (request.substr(0, 13) == "GET /metrics " || request.substr(0, 6) == "GET / ") {
+      snapshot_metrics(); // our own part fresh; the others are at most one interval old
+      body = render_metrics(metrics_board_->total());
+      code = "200 OK";
+    }
+    std::string response = std::string("HTTP/1.1 ") + code +
+                           "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8"
+                           "\r\nContent-Length: " + std::to_string(body.size()) +
+                           "\r\nConnection: close\r\n\r\n" + body;
+    client.response.push(std::make_shared<const std::string>(std::move(response)));
+    if (!client.response.flush(fd) || client.response.empty()) {
+      close_metrics_client(fd);
+      return;
+    }
+    reactor_.modify(fd, EPOLLOUT); // the rest once the socket drains
+  }
+
+  void close_metrics_client(int fd) {
+    reactor_.remove(fd);
+    ::close(fd);
+    metrics_clients_.erase(fd);
+  }
+
+  // peer_status: a status line about one peer coming or going (--quiet
+  // drops these; with thousands of peers they are most of the output)
+  void peer_status(const std::string& text) {
+    if (!quiet_) status(text);
+  }
+
+  // on_peer_closed: res == 0 means the peer hung up; otherwise it's -errno
+  void on_peer_closed(int fd, int res) {
+    if (res == 0) {
+      peer_status("peer " + peers_[fd].name + " disconnected\n");
+    } else {
+      std::cerr << ("connection to " + peers_[fd].name + " failed: " + std::strerror(-res) + "\n");
+    }
+    close_peer(fd);
+  }
+
+  void close_peer(int fd) {
+    Peer& peer = peers_[fd];
+    if (peer.fd < 0) return;
+    add_totals(&closed_totals_, peer); // before forget() drops io_uring's counts
+    ++connections_closed_;
+    if (uring_) uring_->forget(fd);
+    else reactor_.remove(fd);
+    if (peer.outgoing.zerocopy_inflight() > 0) {
+      // The kernel may still read zero-copy buffers we are about to free.
+      // Reset the connection so it drops them now rather than sending
+      // whatever the memory holds later.
+      linger reset = {1, 0};
+      ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    }
+    ::close(fd);
+    peer.fd = -1;
+    peer.incoming_buffer.clear();
+    peer.outgoing.clear();
+    peer.want_write = false;
+    peer.flush_pending = false;
+    peer.framing = FrameState();
+    --peer_count_;
+    if (peer_count_ == 0 && bench_rx_) finish_bench_rx();
+    if (fd == ping_fd_) finish_ping();
+    if (churning_) churn_next();
+    if (peer.candidate >= 0) on_outbound_closed(peer.candidate);
+    if (stopping_) stop_if_flushed();
+  }
+
+  static constexpr size_t kRecvChunk = 4096;          // bytes per recv() call
+  static constexpr size_t kMaxRecvChunk = 1024 * 1024; // ... when a big payload is due
+  static constexpr uint32_t kPeerEvents = EPOLLIN | EPOLLRDHUP; // plus EPOLLOUT while queued
+  static constexpr int64_t kStopLingerMs = 5000;      // most we wait to flush on exit
+  static constexpr size_t kStdinChunk = 256 * 1024;   // bytes per read() of stdin
+  static constexpr size_t kOutputBatchBytes = 64 * 1024; // flush output at this size
+  static constexpr size_t kBenchBatchBytes = 64 * 1024;  // --bench-tx bytes per batch
+  static constexpr int64_t kMetricsSnapshotMs = 1000;    // how stale other Nodes' metrics get
+  static constexpr int64_t kAcceptBackoffMs = 100;       // listener pause after accept4() fails
+  static constexpr int64_t kAcceptLogMs = 1000;          // accept4() errors logged once per
+  static constexpr size_t kMaxMetricsRequest = 8192;     // bigger requests are dropped
+
+  Reactor reactor_;
+  std::unique_ptr<UringEngine> uring_; // null when using plain recv()/send()
+  FrameScratch frame_scratch_;         // shared by every peer's framing
+  std::vector<size_t> newlines_;       // scratch for on_stdin
+  MessageHandler message_handler_;     // empty: print_message
+  std::shared_ptr<OutputSink> output_ = std::make_shared<FdSink>(1, false);
+  bool output_text_ = true;            // output_->wants_text()
+  std::string output_batch_;           // formatted by print_message, not yet written
+  size_t output_messages_ = 0;         // ... and what it holds
+  size_t output_bytes_ = 0;
+  bool bitcoin_framing_ = false;       // --framing=bitcoin
+  size_t send_high_water_ = 4 << 20;   // --send-hwm
+  int coalesce_ms_ = 0;                // --coalesce-ms
+  size_t coalesce_bytes_ = 64 << 10;   // --coalesce-bytes
+  std::vector<int> dirty_;             // peers with a batch waiting to be flushed
+  size_t zerocopy_min_ = 0;            // --zerocopy-min
+  int send_file_fd_ = -1;              // --send-file
+  std::string send_file_path_;
+  off_t send_file_size_ = 0;
+  std::string recv_file_path_;         // --recv-file
+  int recv_file_count_ = 0;
+  std::unordered_map<int, Transfer> transfers_; // by socket fd
+  bool bench_tx_ = false;              // --bench-tx
+  bool bench_rx_ = false;              // --bench-rx
+  size_t bench_count_ = 0;             // --bench-count
+  size_t bench_size_ = 0;              // --bench-size
+  std::string bench_message_;          // one encoded --bench-tx message
+  uint64_t bench_sent_ = 0;            // --bench-tx messages generated so far
+  uint64_t bench_rx_messages_ = 0;     // --bench-rx, since the first message
+  uint64_t bench_rx_bytes_ = 0;
+  UsageSample bench_start_;
+  bool ping_ = false;                  // --ping
+  bool echo_ = false;                  // --echo
+  uint64_t ping_count_ = 0;            // --ping-count
+  int report_ms_ = 1000;               // --report-ms
+  int ping_fd_ = -1;                   // the peer being pinged
+  uint64_t ping_seq_ = 0;              // probe in flight = probes answered
+  Reactor::TimerId ping_timer_ = 0;    // next interval report
+  LatencyHistogram ping_interval_;     // round trips since the last report
+  LatencyHistogram ping_total_;        // ... and since the start
+  bool quiet_ = false;                 // --quiet
+  int stats_ms_ = 0;                   // --stats-ms
+  int tcp_info_ms_ = 0;                // --tcp-info-ms
+  int slow_peer_ms_ = 0;               // --slow-peer-ms
+  LatencyHistogram tcp_rtt_;           // every TCP_INFO RTT sample, for metrics
+  LatencyHistogram ping_all_;          // every --ping round trip, for metrics
+  std::shared_ptr<MetricsBoard> metrics_board_; // null: no --metrics-port
+  size_t metrics_index_ = 0;           // our slot on the board
+  int metrics_fd_ = -1;                // --metrics-port listener (first Node only)
+  std::unordered_map<int, MetricsClient> metrics_clients_;
+  MetricsSnapshot closed_totals_;      // counters of peers already closed
+  uint64_t connections_opened_ = 0;
+  uint64_t connections_closed_ = 0;
+  uint64_t dropped_send_hwm_ = 0;
+  uint64_t dropped_slow_ = 0;
+  bool churning_ = false;              // --bench-churn is running
+  Endpoint churn_endpoint_;
+  std::string churn_name_;
+  uint64_t churn_left_ = 0;            // connections not started yet
+  uint64_t churn_active_ = 0;          // dialing or waiting for the answer
+  uint64_t churn_ended_ = 0;           // closed or failed to connect
+  uint64_t churn_done_ = 0;            // ... after the answer
+  uint64_t churn_start_ns_ = 0;
+  uint64_t churn_interval_ns_ = 0;     // start of this report interval
+  uint64_t churn_interval_done_ = 0;   // churn_done_ then
+  uint64_t churn_steady_ns_ = 0;       // end of the warm-up interval
+  uint64_t churn_steady_done_ = 0;     // churn_done_ then
+  Reactor::TimerId churn_timer_ = 0;
+  LatencyHistogram churn_connect_;     // connect() to handshake done, this interval
+  LatencyHistogram churn_connect_total_;
+  LatencyHistogram churn_accept_;      // connect() to the listener's answer
+  LatencyHistogram churn_accept_total_;
+  bool coalesce_timer_armed_ = false;
+  bool stopping_ = false;              // stdin closed: exit once queues drain
+  std::vector<Peer> peers_; // indexed by fd; fd == -1 marks a free slot
+  size_t peer_count_ = 0;
+  int listen_fd_ = -1;
+  int64_t accept_error_logged_ms_ = 0;   // see pause_listener
+  uint64_t accept_errors_unlogged_ = 0;
+  bool stdin_watched_ = false;
+  RecvBuffer stdin_buffer_;            // stdin bytes not yet split into lines
+  bool stdin_polled_ = false;          // stdin is a file: read from a timer, not epoll
+  bool stdin_paused_ = false;          // every peer is backed up; see peers_have_room
+
+  std::unordered_map<int, Dial> dials_; // by fd
+
+  std::vector<Candidate> candidates_;
+  size_t outbound_target_ = 0;
+  size_t outbound_connected_ = 0;
+  size_t outbound_dialing_ = 0;
+  size_t next_candidate_ = 0;
+  int connect_timeout_ms_ = 5000;
+  Reactor::TimerId retry_timer_ = 0;
+  std::mt19937 rng_{std::random_device{}()};
+
+  int mailbox_fd_ = -1;
+  std::mutex mailbox_mutex_;
+  struct PostedLine {
+    SendQueue::Chunk chunk;
+    size_t messages;
+  };
+  std::vector<PostedLine> mailbox_lines_;  // guarded by mailbox_mutex_
+  bool mailbox_stop_ = false;              // guarded by mailbox_mutex_
+  struct PostedStats {
+    std::shared_ptr<StatsRequest> request;
+    size_t index;                          // our row in it; 0: all in, print
+  };
+  std::vector<PostedStats> mailbox_stats_; // guarded by mailbox_mutex_
+  int signal_fd_ = -1;                     // SIGUSR1, on the stdin Node
+  std::vector<Node*> siblings_;            // only set on the stdin Node
+};
+
+// -------------- worker threads --------------
+
+// pin_to_cpu: keep the calling thread on one core (best effort)
+static void pin_to_cpu(unsigned cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set);
+}
+
+// run_node: one Node per thread. When listening, each has its own
+// SO_REUSEPORT listener on the same port, so the kernel load-balances
+// inbound peers. The main thread runs Node 0, which also owns stdin and
+// maintains the outbound connections.
+static int run_node(const Options& opt) {
+  unsigned threads = static_cast<unsigned>(opt.threads);
+  unsigned cores = std::thread::hardware_concurrency();
+  if (cores == 0) cores = 1;
+  if (threads == 0) threads = cores;
+  bool file_mode = !opt.send_file.empty() || !opt.recv_file.empty();
+  // Extra threads only serve a listener; file transfers are one stream
+  // each, and --bench-tx and --ping drive one thread
+  if (opt.listen_port < 0 || file_mode || opt.bench_tx || opt.ping) threads = 1;
+
+  std::shared_ptr<OutputSink> output = open_output(opt.output);
+  if (!output) return 1;
+
+  // SIGUSR1 (dump stats) is read from a signalfd by the first Node; block
+  // it before any thread starts, so none of them is interrupted by it
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  ::pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+
+  std::vector<std::unique_ptr<Node>> nodes;
+  for (unsigned i = 0; i < threads; ++i) {
+    auto node = std::make_unique<Node>();
+    if (!node->open(opt)) return 1;
+    node->set_output(output);
+    if (opt.listen_port >= 0) {
+      int listen_fd = open_listener(opt.listen_port, threads > 1);
+      if (listen_fd < 0 || !node->add_listener(listen_fd)) return 1;
+      // Connect-only nodes start reading stdin once a peer is connected
+      if (i == 0 && !node->watch_stdin()) return 1;
+    }
+    nodes.push_back(std::move(node));
+  }
+  std::vector<Node*> siblings;
+  for (unsigned i = 1; i < threads; ++i) siblings.push_back(nodes[i].get());
+  nodes[0]->forward_stdin_to(siblings);
+  if (!nodes[0]->watch_signals()) return 1;
+  if (opt.metrics_port >= 0) {
+    auto board = std::make_shared<MetricsBoard>(threads);
+    for (unsigned i = 0; i < threads; ++i) nodes[i]->set_metrics(board, i);
+    int metrics_fd = open_listener(opt.metrics_port, false);
+    if (metrics_fd < 0 || !nodes[0]->add_metrics_listener(metrics_fd)) return 1;
+    std::cout << "serving metrics on port " << opt.metrics_port << "\n";
+  }
+
+  if (opt.listen_port >= 0) {
+    std::cout << "listening on port " << opt.listen_port << " with " << threads
+              << (threads == 1 ? " thread" : " threads") << " ... waiting for peers\n";
+  }
+  if (opt.bench_churn > 0) {
+    nodes[0]->start_churn(opt.connect_to.front(), opt.bench_churn, opt.churn_parallel,
+                          opt.connect_timeout_ms);
+  } else {
+    nodes[0]->start_outbound(opt.connect_to, static_cast<size_t>(opt.outbound),
+                             opt.connect_timeout_ms);
+  }
+  if (opt.reads_stdin()) std::cout << "type a message and press Enter to send; Ctrl+D to quit\n";
+  std::cout.flush(); // received messages bypass std::cout; keep this first
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; ++i) {
+    Node* node = nodes[i].get();
+    workers.emplace_back([node, i, cores] {
+      pin_to_cpu(i % cores);
+      node->run();
+    });
+  }
+  if (threads > 1) pin_to_cpu(0);
+  nodes[0]->run();
+  for (std::thread& worker : workers) worker.join();
+  output->finish();
+  return 0;
+}
+
+// -------------- fan-out benchmark --------------
+
+// thread_cpu_ns: CPU time used so far by the thread with this CPU clock
+static int64_t thread_cpu_ns(clockid_t clock) {
+  timespec ts;
+  if (::clock_gettime(clock, &ts) != 0) return 0;
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// FanoutSubscribers: the receiving end of --bench-fanout. N loopback
+// sockets connected to a Node running on another thread, read by their
+// own Reactor on this one. Each round posts one message to the Node,
+// which broadcasts it to all N, and times its arrival at the first and
+// the last subscriber; the next round starts once all have it. Every
+// message has the same size, so a subscriber's byte count says how many
+// it has received.
+class FanoutSubscribers {
+ public:
+  FanoutSubscribers(Node* node, SendQueue::Chunk message)
+      : node_(node), message_(std::move(message)) {}
+
+  ~FanoutSubscribers() {
+    for (Subscriber& subscriber : subscribers_) ::close(subscriber.fd);
+  }
+
+  // connect: n sockets to the Node's listener on `port`
+  bool connect(int port, size_t n) {
+    if (!reactor_.open()) return false;
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(static_cast<uint16_t>(port));
+    subscribers_.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      // Blocking connect: the listener's backlog takes the whole burst
+      int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        std::cerr << "subscriber connect() failed: " << std::strerror(errno) << "\n";
+        if (fd >= 0) ::close(fd);
+        subscribers_.resize(i);
+        return false;
+      }
+      ::fcntl(fd, F_SETFL, O_NONBLOCK);
+      subscribers_[i].fd = fd;
+      if (!reactor_.add(fd, EPOLLIN, [this, i](uint32_t) { on_readable(i); })) return false;
+    }
+    return true;
+  }
+
+  // run: warm up, then `rounds` timed broadcasts. node_cpu is the Node
+  // thread's CPU clock, so its time per broadcast can be read from here.
+  void run(size_t rounds, clockid_t node_cpu) {
+    rounds_ = rounds;
+    node_cpu_ = node_cpu;
+    warm_up();
+    reactor_.run();
+  }
+
+  const LatencyHistogram& first() const { return first_; }
+  const LatencyHistogram& last() const { return last_; }
+  double cpu_per_round_us() const { return cpu_ns_ / 1e3 / rounds_; }
+
+ private:
+  struct Subscriber {
+    int fd = -1;
+    uint64_t bytes = 0;     // received since counting started
+    uint64_t messages = 0;  // ... in whole messages
+  };
+
+  // warm_up: the Node accepts the subscribers in its own time, and a
+  // broadcast only reaches those it has accepted. Post a message, wait
+  // until nothing has arrived for kSettleMs, and repeat until everyone
+  // has had one; then start counting from zero.
+  void warm_up() {
+    if (Reactor::now_ms() - last_arrival_ms_ < kSettleMs) {
+      reactor_.add_timer(1, [this] { warm_up(); });
+      return;
+    }
+    size_t ready = 0;
+    for (const Subscriber& subscriber : subscribers_) ready += subscriber.bytes > 0;
+    if (ready < subscribers_.size()) {
+      node_->post_line(message_);
+      last_arrival_ms_ = Reactor::now_ms(); // give it time to go out
+      reactor_.add_timer(1, [this] { warm_up(); });
+      return;
+    }
+    for (Subscriber& subscriber : subscribers_) subscriber.bytes = subscriber.messages = 0;
+    counting_ = true;
+    cpu_ns_ = -thread_cpu_ns(node_cpu_);
+    next_round();
+  }
+
+  void next_round() {
+    if (round_ == rounds_) {
+      cpu_ns_ += thread_cpu_ns(node_cpu_);
+      reactor_.stop();
+      return;
+    }
+    ++round_;
+    arrived_ = 0;
+    posted_ns_ = now_ns();
+    node_->post_line(message_);
+  }
+
+  void on_readable(size_t i) {
+    Subscriber& subscriber = subscribers_[i];
+    while (true) {
+      ssize_t n = ::recv(subscriber.fd, buffer_, sizeof(buffer_), 0);
+      if (n <= 0) break; // EAGAIN (or the Node went away)
+      subscriber.bytes += static_cast<uint64_t>(n);
+    }
+    if (!counting_) {
+      last_arrival_ms_ = Reactor::now_ms();
+      return;
+    }
+    while (subscriber.bytes >= (subscriber.messages + 1) * message_->size()) {
+      ++subscriber.messages;
+      on_delivered();
+    }
+  }
+
+  void on_delivered() {
+    uint64_t elapsed = now_ns() - posted_ns_;
+    if (++arrived_ == 1) first_.record(elapsed);
+    if (arrived_ < subscribers_.size()) return;
+    last_.record(elapsed);
+    next_round();
+  }
+
+  static uint64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static constexpr int64_t kSettleMs = 50; // quiet time that ends a warm-up round
+
+  Node* node_;
+  SendQueue::Chunk message_;
+  Reactor reactor_;
+  std::vector<Subscriber> subscribers_;
+  bool counting_ = false;
+  int64_t last_arrival_ms_ = 0; // warm-up: when bytes last came in
+  size_t rounds_ = 0;
+  size_t round_ = 0;
+  size_t arrived_ = 0;          // subscribers that have this round's message
+  uint64_t posted_ns_ = 0;      // when this round was handed to the Node
+  clockid_t node_cpu_ = CLOCK_THREAD_CPUTIME_ID;
+  int64_t cpu_ns_ = 0;          // Node CPU over the timed rounds
+  LatencyHistogram first_;      // post to first delivery
+  LatencyHistogram last_;       // post to last delivery
+  char buffer_[64 * 1024];
+};
+
+// kFanoutSpareFds: descriptors the benchmark needs besides its sockets
+// (stdio, epoll, eventfds, the listener, an io_uring ring)
+static constexpr size_t kFanoutSpareFds = 32;
+
+// run_fanout_benchmark: for 1, 2, 4 ... --bench-fanout subscribers, a
+// fresh Node (with the command line's engine, framing and send options)
+// broadcasts --fanout-rounds messages; print delivery times and the
+// Node's CPU per broadcast, total and per subscriber, which should stay
+// flat if broadcast scales linearly
+static int run_fanout_benchmark(Options opt) {
+  opt.quiet = true;
+  // Every subscriber is two sockets in this process
+  rlimit files;
+  if (::getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+    files.rlim_cur = files.rlim_max;
+    ::setrlimit(RLIMIT_NOFILE, &files);
+  }
+  if (::getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur != RLIM_INFINITY &&
+      2 * opt.bench_fanout + kFanoutSpareFds > files.rlim_cur) {
+    std::cerr << "--bench-fanout " << opt.bench_fanout << " needs "
+              << 2 * opt.bench_fanout + kFanoutSpareFds << " file descriptors; the limit is "
+              << files.rlim_cur << " (raise it with ulimit -n)\n";
+    return 1;
+  }
+
+  std::string payload(opt.bench_size, 'x');
+  std::string wire;
+  if (opt.framing == "bitcoin") append_bitcoin_message(&wire, "bench", payload);
+  else wire = payload + "\n";
+  auto message = std::make_shared<const std::string>(std::move(wire));
+
+  std::vector<size_t> counts;
+  for (size_t n = 1; n < opt.bench_fanout; n *= 2) counts.push_back(n);
+  counts.push_back(opt.bench_fanout);
+
+  std::cout << "subscribers   first p50    last p50    last p99    last max   cpu/bcast   "
+               "cpu/peer (us)\n";
+  for (size_t n : counts) {
+    Node node;
+    if (!node.open(opt)) return 1;
+    node.set_output(std::make_shared<NullSink>());
+    int listen_fd = open_listener(0, false);
+    sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    if (listen_fd < 0 ||
+        ::getsockname(listen_fd, reinterpret_cast<sockaddr*>(&addr), &len) < 0 ||
+        !node.add_listener(listen_fd)) {
+      return 1;
+    }
+    std::thread thread([&node] { node.run(); });
+    clockid_t node_cpu;
+    if (::pthread_getcpuclockid(thread.native_handle(), &node_cpu) != 0) {
+      node_cpu = CLOCK_THREAD_CPUTIME_ID; // can't happen on Linux
+    }
+
+    bool ok;
+    {
+      FanoutSubscribers subscribers(&node, message);
+      ok = subscribers.connect(ntohs(addr.sin_port), n);
+      if (ok) {
+        subscribers.run(opt.fanout_rounds, node_cpu);
+        char line[160];
+        std::snprintf(line, sizeof(line), "%11zu %11.1f %11.1f %11.1f %11.1f %11.1f %11.3f\n", n,
+                      subscribers.first().percentile(50) / 1e3,
+                      subscribers.last().percentile(50) / 1e3,
+                      subscribers.last().percentile(99) / 1e3, subscribers.last().max() / 1e3,
+                      subscribers.cpu_per_round_us(), subscribers.cpu_per_round_us() / n);
+        std::cout << line << std::flush;
+      }
+      node.post_stop();
+      thread.join();
+    }
+    if (!ok) return 1;
+  }
+  return 0;
+}
+
+// -------------- main --------------
+
+int main(int argc, char** argv) {
+  Options opt;
+  if (!parse_options(argc, argv, &opt)) {
+    // If we got here, the arguments were wrong; show help.
+    std::cerr << "Usage:\n"
+              << "  " << argv[0] << " --listen <port> [options]\n"
+              << "  " << argv[0] << " --connect <host> <port> [--connect <host> <port> ...] [options]\n"
+              << "  (--listen and --connect may be combined)\n"
+              << "Options:\n"
+              << "  --engine=epoll|uring   socket I/O engine (default epoll)\n"
+              << "  --framing=line|bitcoin messages are lines, or Bitcoin P2P messages;\n"
+              << "                         in bitcoin mode type \"<command> <payload>\"\n"
+              << "  --threads N            listener threads, one per core if 0 (default 1)\n"
+              << "  --connect-timeout MS   give up on a dial after MS (default 5000)\n"
+              << "  --outbound N           outbound peers to keep connected (default all)\n"
+              << "  --send-hwm BYTES       drop a peer with more than this queued for it\n"
+              << "                         (default 4194304)\n"
+              << "  --coalesce-ms MS       batch a peer's sends for up to MS (default 0:\n"
+              << "                         until the end of the loop iteration)\n"
+              << "  --coalesce-bytes BYTES send at once when this much is queued\n"
+              << "                         (default 65536)\n"
+              << "  --zerocopy-min BYTES   send messages this large with MSG_ZEROCOPY\n"
+              << "                         (default 0: off; 16384 or more is sensible)\n"
+              << "  --send-file PATH       stream PATH to each peer (sendfile) instead of\n"
+              << "                         sending messages\n"
+              << "  --recv-file PATH       write each peer's stream to PATH (PATH.1, ...\n"
+              << "                         for later peers) with splice\n"
+              << "  --output SINK          where received messages go: stdout (default),\n"
+              << "                         file:PATH, null (format only) or count\n"
+              << "  --quiet                no line for each peer connecting or leaving\n"
+              << "  --stats-ms MS          print per-peer stats every MS (also on SIGUSR1)\n"
+              << "  --tcp-info-ms MS       sample each peer's TCP_INFO every MS (default\n"
+              << "                         1000; 0 = off)\n"
+              << "  --slow-peer-ms MS      drop a peer that has been more than MS behind\n"
+              << "                         for MS, judged from TCP_INFO (default 0: off)\n"
+              << "  --metrics-port PORT    serve Prometheus metrics over HTTP on PORT\n"
+              << "  --bench-tx             send --bench-count messages of --bench-size\n"
+              << "                         bytes as fast as peers take them, then report\n"
+              << "  --bench-rx             count what peers send; report when they leave\n"
+              << "  --bench-size BYTES     benchmark payload size (default 64)\n"
+              << "  --bench-count N        benchmark messages (default 1000000)\n"
+              << "  --bench-framing        time the framing strategies on synthetic\n"
+              << "                         buffers (no sockets), then exit\n"
+              << "  --bench-churn N        open N connections to the first --connect\n"
+              << "                         endpoint (run with --echo), each sending one\n"
+              << "                         probe and closing on the answer; report rates\n"
+              << "  --churn-parallel N     churn connections at a time (default 32)\n"
+              << "  --bench-fanout N       broadcast --bench-size messages from one node to\n"
+              << "                         1, 2, 4 ... N loopback subscribers, then exit\n"
+              << "  --fanout-rounds R      broadcasts per subscriber count (default 1000)\n"
+              << "  --ping                 send timestamped probes to the first peer, one\n"
+              << "                         at a time, and report round-trip percentiles\n"
+              << "  --echo                 answer --ping probes\n"
+              << "  --ping-count N         probes before the final report (default 100000)\n"
+              << "  --report-ms MS         latency report interval (default 1000)\n";
+    return 2;
   }
 
-  // If we got here, the arguments were wrong; show help.
-  std::cerr << "Usage:\n"
-            << "  " << argv[0] << " --listen <port>\n"
-            << "  " << argv[0] << " --connect <host> <port>\n";
-  return 1;
+  if (opt.bench_framing) return run_framing_benchmark();
+  if (opt.bench_fanout > 0) return run_fanout_benchmark(opt);
+  return run_node(opt);
 }